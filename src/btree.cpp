@@ -5,8 +5,13 @@
  * Copyright (c) 2012 Database Group, Computer Sciences Department, University of Wisconsin-Madison.
  */
 
+#include <algorithm>
+#include <memory>
+#include <queue>
+#include <utility>
 #include "btree.h"
 #include "filescan.h"
+#include "exceptions/badgerdb_exception.h"
 #include "exceptions/bad_index_info_exception.h"
 #include "exceptions/bad_opcodes_exception.h"
 #include "exceptions/bad_scanrange_exception.h"
@@ -21,6 +26,227 @@
 namespace badgerdb
 {
 
+namespace
+{
+
+/**
+ * Number of (key, rid) pairs stored in one page of a sorted run.
+ */
+const int RUNPAGESIZE = Page::SIZE / sizeof(RIDKeyPair<int>);
+
+/**
+ * A sorted run of (key, rid) pairs spilled to the temporary sort file.
+ * Pages of a run are contiguous in the sort file.
+ */
+struct SortRun
+{
+  PageId firstPageNo;
+  int numEntries;
+};
+
+/**
+ * Owns the temporary sort file of a bulk load, closes and removes it when the load
+ * ends, whether it completes or throws.
+ */
+struct SortFileGuard
+{
+  explicit SortFileGuard(const std::string &fileName)
+    : fileName(fileName)
+  {
+  }
+
+  ~SortFileGuard()
+  {
+    if (file)
+    {
+      file.reset();
+      try
+      {
+        File::remove(fileName);
+      }
+      catch (const BadgerDbException &e)
+      {
+      }
+    }
+  }
+
+  std::string fileName;
+  std::unique_ptr<BlobFile> file;
+};
+
+/**
+ * Sort and write the given run to the sort file, one page at a time, and clear it.
+ * @param runFile sort file
+ * @param run     pairs to spill
+ * @param runs    list of spilled runs, the new run is appended to it
+ */
+void spillRun(File *runFile, std::vector<RIDKeyPair<int> > &run, std::vector<SortRun> &runs)
+{
+  std::sort(run.begin(), run.end());
+
+  SortRun sortRun;
+  sortRun.numEntries = run.size();
+  for (std::size_t i = 0; i < run.size(); i += RUNPAGESIZE)
+  {
+    PageId pageNo;
+    Page page = runFile->allocatePage(pageNo);
+    if (i == 0)
+    {
+      sortRun.firstPageNo = pageNo;
+    }
+    std::size_t count = std::min((std::size_t)RUNPAGESIZE, run.size() - i);
+    memcpy((void *)&page, &run[i], count * sizeof(RIDKeyPair<int>));
+    runFile->writePage(pageNo, page);
+  }
+  runs.push_back(sortRun);
+  run.clear();
+}
+
+/**
+ * Merges the spilled runs and the last, in-memory, run into a single sorted stream.
+ * Run pages are read straight from the sort file so the merge does not evict pages from the buffer pool.
+ */
+class SortedRunMerger
+{
+ public:
+  SortedRunMerger(File *runFile, const std::vector<SortRun> &runs, const std::vector<RIDKeyPair<int> > &memRun)
+    : runFile(runFile), cursors(runs.size()), memRun(memRun), memPos(0)
+  {
+    for (std::size_t i = 0; i < runs.size(); i++)
+    {
+      cursors[i].pageNo = runs[i].firstPageNo;
+      cursors[i].remaining = runs[i].numEntries;
+      cursors[i].pos = 0;
+      runFile->readPageInto(cursors[i].pageNo, cursors[i].page);
+    }
+    for (std::size_t i = 0; i <= cursors.size(); i++)
+    {
+      HeapItem item;
+      item.source = i;
+      if (advance(i, item.entry))
+      {
+        heap.push(item);
+      }
+    }
+  }
+
+  /**
+   * Fetch the next pair in sorted order.
+   * @param entry pair returned in this
+   * @return      false if all runs are exhausted
+   */
+  bool next(RIDKeyPair<int> &entry)
+  {
+    if (heap.empty())
+    {
+      return false;
+    }
+    HeapItem item = heap.top();
+    heap.pop();
+    entry = item.entry;
+    if (advance(item.source, item.entry))
+    {
+      heap.push(item);
+    }
+    return true;
+  }
+
+ private:
+  struct Cursor
+  {
+    PageId pageNo;
+    int remaining;
+    int pos;
+    Page page;
+  };
+
+  struct HeapItem
+  {
+    RIDKeyPair<int> entry;
+    std::size_t source;
+
+    // inverted so that std::priority_queue pops the smallest pair first
+    bool operator<(const HeapItem &rhs) const
+    {
+      return rhs.entry < entry;
+    }
+  };
+
+  /**
+   * Take the next pair of one source, the in-memory run being the source after all spilled runs.
+   */
+  bool advance(std::size_t source, RIDKeyPair<int> &entry)
+  {
+    if (source == cursors.size())
+    {
+      if (memPos == memRun.size())
+      {
+        return false;
+      }
+      entry = memRun[memPos++];
+      return true;
+    }
+
+    Cursor &cursor = cursors[source];
+    if (cursor.remaining == 0)
+    {
+      return false;
+    }
+    if (cursor.pos == RUNPAGESIZE)
+    {
+      cursor.pageNo++;
+      runFile->readPageInto(cursor.pageNo, cursor.page);
+      cursor.pos = 0;
+    }
+    entry = ((RIDKeyPair<int> *)&cursor.page)[cursor.pos++];
+    cursor.remaining--;
+    return true;
+  }
+
+  File *runFile;
+  std::vector<Cursor> cursors;
+  const std::vector<RIDKeyPair<int> > &memRun;
+  std::size_t memPos;
+  std::priority_queue<HeapItem> heap;
+};
+
+/**
+ * Branch-free binary search over the sorted keys of a node. The loop body compiles to a
+ * conditional move, so a search costs log2(n) comparisons and no mispredicted branches.
+ * @param keys    sorted key array
+ * @param n       number of keys in use
+ * @param key     key to search for
+ * @param strict  search for the first key greater than key instead of greater or equal
+ * @return        index of the first matching key, n if there is none
+ */
+int keySearch(const int *keys, int n, int key, bool strict)
+{
+  if (n == 0)
+  {
+    return 0;
+  }
+  const int *base = keys;
+  if (strict)
+  {
+    while (n > 1)
+    {
+      const int half = n / 2;
+      base = (base[half] <= key) ? base + half : base;
+      n -= half;
+    }
+    return (base - keys) + (*base <= key);
+  }
+  while (n > 1)
+  {
+    const int half = n / 2;
+    base = (base[half] < key) ? base + half : base;
+    n -= half;
+  }
+  return (base - keys) + (*base < key);
+}
+
+}
+
 // -----------------------------------------------------------------------------
 // BTreeIndex::BTreeIndex -- Constructor
 // -----------------------------------------------------------------------------  
@@ -32,12 +258,16 @@ namespace badgerdb
  * @param bufMgrIn        buffer pool
  * @param attrByteOffset  off set of the attribute
  * @param attrType        attribute data type
+ * @param bulkLoad        build a new index bottom-up instead of inserting entry by entry
+ * @param fillFactor      fraction of key slots filled in each node when bulk loading
  */
 BTreeIndex::BTreeIndex(const std::string & relationName,
     std::string & outIndexName,
     BufMgr *bufMgrIn,
     const int attrByteOffset,
-    const Datatype attrType)
+    const Datatype attrType,
+    const bool bulkLoad,
+    const double fillFactor)
 {
   
   //Construncting an index name
@@ -59,57 +289,66 @@ BTreeIndex::BTreeIndex(const std::string & relationName,
     //check if file exists
     file = new BlobFile(outIndexName, false);
     headerPageNum = file->getFirstPageNo();
-    Page *headerPage;
-    bufMgr->readPage(file, headerPageNum, headerPage);
-    IndexMetaInfo *metaInfo = (IndexMetaInfo *)headerPage;
+    PageHandle headerPage = bufMgr->pinPage(file, headerPageNum);
+    IndexMetaInfo *metaInfo = (IndexMetaInfo *)headerPage.get();
     rootPageNum = metaInfo->rootPageNo;
+    // the root starts out as the leaf allocated right after the meta page
+    initialRootPageNum = headerPageNum + 1;
 
     if (relationName != metaInfo->relationName || attrType != metaInfo->attrType 
-      || attrByteOffset != metaInfo->attrByteOffset)
+      || attrByteOffset != metaInfo->attrByteOffset || metaInfo->formatVersion != INDEXFORMATVERSION)
     {
       throw BadIndexInfoException(outIndexName);
     }
-
-    bufMgr->unPinPage(file, headerPageNum, false);    
   }
   //create new file if file does not exist 
   catch(FileNotFoundException e)
   {
     //File did not exist from upon, thus create a new blob file
     file = new BlobFile(outIndexName, true);
-    Page *headerPage;
-    Page *rootPage;
-    bufMgr->allocPage(file, headerPageNum, headerPage);
-    bufMgr->allocPage(file, rootPageNum, rootPage);
+    PageHandle headerPage = bufMgr->pinNewPage(file, headerPageNum);
+    PageHandle rootPage = bufMgr->pinNewPage(file, rootPageNum);
 
     //initialize meta data
-    IndexMetaInfo *metaInfo = (IndexMetaInfo *)headerPage;
+    IndexMetaInfo *metaInfo = (IndexMetaInfo *)headerPage.get();
     metaInfo->attrByteOffset = attrByteOffset;
     metaInfo->attrType = attrType;
     metaInfo->rootPageNo = rootPageNum;
+    metaInfo->formatVersion = INDEXFORMATVERSION;
     memcpy(metaInfo->relationName, relationName.c_str(), relationName.size());
     metaInfo->relationName[relationName.size()] = '\0';
     
     // initiaize root
     initialRootPageNum = rootPageNum;
-    LeafNodeInt *root = (LeafNodeInt *)rootPage;
+    LeafNodeInt *root = (LeafNodeInt *)rootPage.get();
+    root->numKeys = 0;
     root->rightSibPageNo = 0;
 
-    bufMgr->unPinPage(file, headerPageNum, true);
-    bufMgr->unPinPage(file, rootPageNum, true);
+    headerPage.markDirty();
+    rootPage.markDirty();
+    headerPage.release();
+    rootPage.release();
 
+    if (bulkLoad)
+    {
+      this->bulkLoad(relationName, fillFactor);
+      bufMgr->flushFile(file);
+    }
+    else
     {
-      //insert relation
-      FileScan fscan(relationName, bufMgr);
+      //insert relation, reading it through a ring so the index nodes stay buffered
+      FileScan fscan(relationName, bufMgr, BUFFERRING_SIZE);
       try
       {
         RecordId scanRid;
         while(1)
         {
           fscan.scanNext(scanRid);
-          std::string recordStr = fscan.getRecord();
-          void* key = (void*)(recordStr.c_str() + attrByteOffset);
-          insertEntry(key, scanRid);
+          // records are not aligned on the page, copy the key out
+          const RecordView record = fscan.getRecordView();
+          int key;
+          memcpy(&key, record.data + attrByteOffset, sizeof(int));
+          insertEntry(&key, scanRid);
         }
       }
       catch(const EndOfFileException &e)
@@ -120,6 +359,163 @@ BTreeIndex::BTreeIndex(const std::string & relationName,
   }
 }
 
+// -----------------------------------------------------------------------------
+// BTreeIndex::bulkLoad
+// -----------------------------------------------------------------------------
+
+/**
+ * function to build the index bottom-up from the sorted entries of the relation
+ * @param relationName  relation name
+ * @param fillFactor    fraction of key slots filled in each node
+ */
+const void BTreeIndex::bulkLoad(const std::string &relationName, const double fillFactor)
+{
+  // keep at most a buffer pool worth of pairs in memory, spill sorted runs beyond that
+  const std::size_t runCapacity = (std::size_t)bufMgr->getNumBufs() * RUNPAGESIZE;
+  SortFileGuard runFile(file->filename() + ".sort");
+  std::vector<SortRun> runs;
+  std::vector<RIDKeyPair<int> > run;
+  int numEntries = 0;
+
+  {
+    FileScan fscan(relationName, bufMgr, BUFFERRING_SIZE);
+    try
+    {
+      RecordId scanRid;
+      while(1)
+      {
+        fscan.scanNext(scanRid);
+        const RecordView record = fscan.getRecordView();
+        int key;
+        memcpy(&key, record.data + attrByteOffset, sizeof(int));
+        RIDKeyPair<int> entry;
+        entry.set(scanRid, key);
+        run.push_back(entry);
+        numEntries++;
+
+        if (run.size() >= runCapacity)
+        {
+          if (!runFile.file)
+          {
+            // left over by an earlier build that did not finish
+            if (File::exists(runFile.fileName))
+            {
+              File::remove(runFile.fileName);
+            }
+            runFile.file.reset(new BlobFile(runFile.fileName, true));
+          }
+          spillRun(runFile.file.get(), run, runs);
+        }
+      }
+    }
+    catch(const EndOfFileException &e)
+    {
+    }
+  }
+  std::sort(run.begin(), run.end());
+  SortedRunMerger merger(runFile.file.get(), runs, run);
+
+  // spread the entries evenly over the fewest leaves holding at most leafFill keys each,
+  // the initial root page becomes the leftmost leaf
+  const double fill = std::min(1.0, std::max(0.0, fillFactor));
+  const int leafFill = std::max(1, (int)(leafOccupancy * fill));
+  std::vector<PageKeyPair<int> > leaves;
+  if (numEntries > 0)
+  {
+    const int numLeaves = (numEntries + leafFill - 1) / leafFill;
+    PageHandle leafPage = bufMgr->pinPage(file, initialRootPageNum);
+
+    for (int l = 0; l < numLeaves; l++)
+    {
+      LeafNodeInt *leaf = (LeafNodeInt *)leafPage.get();
+      const int count = numEntries / numLeaves + (l < numEntries % numLeaves ? 1 : 0);
+      RIDKeyPair<int> entry;
+      for (int i = 0; i < count; i++)
+      {
+        merger.next(entry);
+        leaf->keyArray[i] = entry.key;
+        leaf->ridArray[i] = entry.rid;
+      }
+      leaf->numKeys = count;
+
+      PageKeyPair<int> leafEntry;
+      leafEntry.set(leafPage.pageNo(), leaf->keyArray[0]);
+      leaves.push_back(leafEntry);
+      leafPage.markDirty();
+
+      if (l == numLeaves - 1)
+      {
+        leaf->rightSibPageNo = 0;
+        leafPage.release();
+      }
+      else
+      {
+        PageId nextPageNum;
+        PageHandle nextPage = bufMgr->pinNewPage(file, nextPageNum);
+        leaf->rightSibPageNo = nextPageNum;
+        // unpins the finished leaf
+        leafPage = std::move(nextPage);
+      }
+    }
+  }
+
+  if (leaves.size() > 1)
+  {
+    bulkLoadNonLeafLevels(leaves, true, fill);
+  }
+}
+
+/**
+ * function to build the non-leaf levels of a bulk loaded index
+ * @param children          first key and page number of each node on the level below
+ * @param childrenAreLeaves true if the level below is the leaf level
+ * @param fillFactor        fraction of key slots filled in each node
+ */
+const void BTreeIndex::bulkLoadNonLeafLevels(std::vector<PageKeyPair<int> > &children, bool childrenAreLeaves, const double fillFactor)
+{
+  const int nodeFill = std::max(1, (int)(nodeOccupancy * fillFactor));
+
+  while (children.size() > 1)
+  {
+    const int numChildren = children.size();
+    const int numNodes = (numChildren + nodeFill) / (nodeFill + 1);
+    std::vector<PageKeyPair<int> > parents;
+    int next = 0;
+
+    for (int n = 0; n < numNodes; n++)
+    {
+      PageId nodePageNum;
+      PageHandle nodePage = bufMgr->pinNewPage(file, nodePageNum);
+      nodePage.markDirty();
+      NonLeafNodeInt *node = (NonLeafNodeInt *)nodePage.get();
+      node->level = childrenAreLeaves ? 1 : 0;
+
+      const int count = numChildren / numNodes + (n < numChildren % numNodes ? 1 : 0);
+      node->pageNoArray[0] = children[next].pageNo;
+      for (int i = 1; i < count; i++)
+      {
+        node->keyArray[i - 1] = children[next + i].key;
+        node->pageNoArray[i] = children[next + i].pageNo;
+      }
+      node->numKeys = count - 1;
+
+      PageKeyPair<int> parentEntry;
+      parentEntry.set(nodePageNum, children[next].key);
+      parents.push_back(parentEntry);
+      next += count;
+    }
+
+    children.swap(parents);
+    childrenAreLeaves = false;
+  }
+
+  PageHandle metaInfo = bufMgr->pinPage(file, headerPageNum);
+  metaInfo.markDirty();
+  IndexMetaInfo *metaPage = (IndexMetaInfo *)metaInfo.get();
+  metaPage->rootPageNo = children[0].pageNo;
+  rootPageNum = children[0].pageNo;
+}
+
 // -----------------------------------------------------------------------------
 // BTreeIndex::~BTreeIndex -- destructor
 // -----------------------------------------------------------------------------
@@ -129,6 +525,9 @@ BTreeIndex::BTreeIndex(const std::string & relationName,
  */
 BTreeIndex::~BTreeIndex()
 {
+  // a scan left open must not keep the file from being flushed
+  currentPage.release();
+  scanExecuting = false;
   bufMgr->flushFile(BTreeIndex::file);
   delete file;
 }
@@ -146,17 +545,18 @@ BTreeIndex::~BTreeIndex()
 	{
 		RIDKeyPair<int> de;
 		de.set(rid, *((int *)k));
-		Page *r;
-		bufMgr->readPage(file, rootPageNum, r);
+		PageHandle r = bufMgr->pinPage(file, rootPageNum);
 		PageKeyPair<int> *nce = nullptr;
 		if (initialRootPageNum == rootPageNum)
 		{
-			insert(r, rootPageNum, true, de, nce);
+			insert(r, true, de, nce);
 		}
 		else
 		{
-			insert(r, rootPageNum, false, de, nce);
+			insert(r, false, de, nce);
 		}
+		// a split root has already been replaced by updateRootNode
+		delete nce;
 	}
 
 /**
@@ -167,57 +567,41 @@ BTreeIndex::~BTreeIndex()
 */
 	const void BTreeIndex::findNextNonLeafNode(NonLeafNodeInt *curNode, PageId &nextNodeNum, int key)
 	{
-		int counter = nodeOccupancy;
-		for(int i = counter; i >= 0; i--) {
-			if(curNode->pageNoArray[i] != 0) {
-				break;
-			}
-			counter--;
-		}
-
-		for(int i = counter; i > 0; i--) {
-			if(curNode->keyArray[i - 1] < key) {
-				break;
-			}
-			counter--;
-		}
-		nextNodeNum = curNode->pageNoArray[counter];
+		// child i covers the keys in (keyArray[i-1], keyArray[i]]
+		nextNodeNum = curNode->pageNoArray[keySearch(curNode->keyArray, curNode->numKeys, key, false)];
 	}
 
 /**
  * function to insert index entry to index file
- * @param curPage     current page
- * @param curPageNum  current Page PageId
+ * @param cp          current page, unpinned on return
  * @param isLeafNode  check if current page is a leaf node
  * @param dataEntry   entry which needs to be inserted
  * @param newEntry    entry need to be moved up after splited, would be null if split is not necessary
 */
-const void BTreeIndex::insert(Page *cp, PageId cpn, bool leaf, const RIDKeyPair<int> de, PageKeyPair<int> *&nce)
+const void BTreeIndex::insert(PageHandle &cp, bool leaf, const RIDKeyPair<int> de, PageKeyPair<int> *&nce)
 	{
 
 		if (leaf)
 		{
-			LeafNodeInt *leaf = (LeafNodeInt *)cp;
-			if (leaf->ridArray[leafOccupancy - 1].page_number == 0)
+			LeafNodeInt *leaf = (LeafNodeInt *)cp.get();
+			cp.markDirty();
+			if (leaf->numKeys < leafOccupancy)
 			{
 				insertLeafNode(leaf, de);
 				nce = nullptr;
 
-				bufMgr->unPinPage(file, cpn, true);
+				cp.release();
 			}
 			else
 			{
-				splitLeafNode(leaf, cpn, nce, de);
+				splitLeafNode(cp, nce, de);
 			}
 			return;
 		}
 		PageId nextNodeNum;
-		NonLeafNodeInt *curNode = (NonLeafNodeInt *)cp;
-
-		Page *nextPage;
+		NonLeafNodeInt *curNode = (NonLeafNodeInt *)cp.get();
 
 		findNextNonLeafNode(curNode, nextNodeNum, de.key);
-		bufMgr->readPage(file, nextNodeNum, nextPage);
 		if (curNode->level == 1)
 		{
 			leaf = true;
@@ -226,24 +610,32 @@ const void BTreeIndex::insert(Page *cp, PageId cpn, bool leaf, const RIDKeyPair<
 		{
 			leaf = false;
 		}
-		insert(nextPage, nextNodeNum, leaf, de, nce);
 
-		if (nce == nullptr)
+		// only one page is held on the way down, the parent is read again if the child splits
+		const PageId cpn = cp.pageNo();
+		cp.release();
 		{
-			bufMgr->unPinPage(file, cpn, false);
+			PageHandle nextPage = bufMgr->pinPage(file, nextNodeNum);
+			insert(nextPage, leaf, de, nce);
 		}
-		else
+
+		if (nce != nullptr)
 		{
-			if (curNode->pageNoArray[nodeOccupancy] == 0)
+			cp = bufMgr->pinPage(file, cpn);
+			cp.markDirty();
+			curNode = (NonLeafNodeInt *)cp.get();
+			PageKeyPair<int> *childEntry = nce;
+			if (curNode->numKeys < nodeOccupancy)
 			{
-				insertNonLeafNode(curNode, nce);
+				insertNonLeafNode(curNode, childEntry);
 				nce = nullptr;
-				bufMgr->unPinPage(file, cpn, true);
+				cp.release();
 			}
 			else
 			{
-				splitNonLeafNode(curNode, cpn, nce);
+				splitNonLeafNode(cp, nce);
 			}
+			delete childEntry;
 		}
 	}
 
@@ -253,22 +645,14 @@ const void BTreeIndex::insert(Page *cp, PageId cpn, bool leaf, const RIDKeyPair<
  * @param entry     then entry needed to be inserted
  */
 const void BTreeIndex::insertLeafNode(LeafNodeInt *cur_leaf, RIDKeyPair<int> entry) {
-  // it's empty
-  if (cur_leaf->ridArray[0].page_number == 0) {
-    cur_leaf->keyArray[0] = entry.key;
-    cur_leaf->ridArray[0] = entry.rid;
-  } else {
-    int i = leafOccupancy - 1;
-    while(i >= 0 && (cur_leaf->ridArray[i].page_number == 0)){
-      i--;
-    }
-    for(;i >= 0 && (cur_leaf->keyArray[i] > entry.key);i--) {
-      cur_leaf->keyArray[i+1] = cur_leaf->keyArray[i];
-      cur_leaf->ridArray[i+1] = cur_leaf->ridArray[i];
-    }
-    cur_leaf->keyArray[i+1] = entry.key;
-    cur_leaf->ridArray[i+1] = entry.rid;
-  }
+  // insert after any equal keys
+  const int i = keySearch(cur_leaf->keyArray, cur_leaf->numKeys, entry.key, true);
+  const int numMoved = cur_leaf->numKeys - i;
+  memmove(&cur_leaf->keyArray[i + 1], &cur_leaf->keyArray[i], numMoved * sizeof(int));
+  memmove(&cur_leaf->ridArray[i + 1], &cur_leaf->ridArray[i], numMoved * sizeof(RecordId));
+  cur_leaf->keyArray[i] = entry.key;
+  cur_leaf->ridArray[i] = entry.rid;
+  cur_leaf->numKeys++;
 }
 
 /**
@@ -278,70 +662,61 @@ const void BTreeIndex::insertLeafNode(LeafNodeInt *cur_leaf, RIDKeyPair<int> ent
  *
  */
 const void BTreeIndex::insertNonLeafNode(NonLeafNodeInt *cur_nonleaf, PageKeyPair<int> *entry) {
-  int i = nodeOccupancy;
-  while(i >= 0 && (cur_nonleaf->pageNoArray[i] == 0)){
-    i--;
-  }
-  for(;i > 0 && (cur_nonleaf->keyArray[i - 1] > entry->key); i--) {
-    cur_nonleaf->keyArray[i] = cur_nonleaf->keyArray[i - 1];
-    cur_nonleaf->pageNoArray[i + 1] = cur_nonleaf->pageNoArray[i];
-  }
-
+  // the new child goes right of its key
+  const int i = keySearch(cur_nonleaf->keyArray, cur_nonleaf->numKeys, entry->key, true);
+  const int numMoved = cur_nonleaf->numKeys - i;
+  memmove(&cur_nonleaf->keyArray[i + 1], &cur_nonleaf->keyArray[i], numMoved * sizeof(int));
+  memmove(&cur_nonleaf->pageNoArray[i + 2], &cur_nonleaf->pageNoArray[i + 1], numMoved * sizeof(PageId));
   cur_nonleaf->keyArray[i] = entry->key;
   cur_nonleaf->pageNoArray[i + 1] = entry->pageNo;
-} 
+  cur_nonleaf->numKeys++;
+}
 
 /**
  * function to insert a index entry which need to be splited
- * @param oldNode       the node which needs to be splited
- * @param oldPageNumer  odl PageId
- * @param newEntry      the new entry to add
+ * @param oldPage       the node which needs to be splited, unpinned on return
+ * @param newEntry      the new entry to add, replaced by the entry to move up
 */
-const void BTreeIndex::splitNonLeafNode(NonLeafNodeInt *oldNode, PageId oldPageNumber, PageKeyPair<int> *&newEntry)
+const void BTreeIndex::splitNonLeafNode(PageHandle &oldPage, PageKeyPair<int> *&newEntry)
 {
-  
-  Page *newPage;
+
+  NonLeafNodeInt *oldNode = (NonLeafNodeInt *)oldPage.get();
+  const PageId oldPageNumber = oldPage.pageNo();
   PageId newPageNumber;
   // allocate a new node (nonleaf)
-  bufMgr->allocPage(file, newPageNumber, newPage);
-  NonLeafNodeInt *newNode = (NonLeafNodeInt *)newPage;
-
-  // split index
-  int mid = nodeOccupancy/2;
-  int moveUpIndex = mid;
-  PageKeyPair<int> moveUpEntry;
-  
-  // even keys scenario
-  if (nodeOccupancy % 2 == 0){
-    moveUpIndex = newEntry->key < oldNode->keyArray[mid] ? mid -1 : mid;
-  }
+  PageHandle newPage = bufMgr->pinNewPage(file, newPageNumber);
+  NonLeafNodeInt *newNode = (NonLeafNodeInt *)newPage.get();
 
-  moveUpEntry.set(newPageNumber, oldNode->keyArray[moveUpIndex]);
+  // split index, the key at moveUpIndex moves up to the parent
+  int moveUpIndex = nodeOccupancy/2;
 
-  mid = moveUpIndex + 1;
-
-  // move entries to the new node
-  for(int i = mid; i < nodeOccupancy; i++) {
-    newNode->keyArray[i-mid] = oldNode->keyArray[i];
-    newNode->pageNoArray[i-mid] = oldNode->pageNoArray[i+1];
-    oldNode->pageNoArray[i+1] = (PageId) 0;
-    oldNode->keyArray[i+1] = 0;
+  // even keys scenario, keep both halves equal once the new entry is in
+  if (nodeOccupancy % 2 == 0 && newEntry->key < oldNode->keyArray[moveUpIndex]){
+    moveUpIndex--;
   }
 
+  PageKeyPair<int> *moveUpEntry = new PageKeyPair<int>();
+  moveUpEntry->set(newPageNumber, oldNode->keyArray[moveUpIndex]);
+
+  // move the keys right of it and their children to the new node
+  const int numMoved = nodeOccupancy - moveUpIndex - 1;
+  memcpy(newNode->keyArray, &oldNode->keyArray[moveUpIndex + 1], numMoved * sizeof(int));
+  memcpy(newNode->pageNoArray, &oldNode->pageNoArray[moveUpIndex + 1], (numMoved + 1) * sizeof(PageId));
+  newNode->numKeys = numMoved;
   newNode->level = oldNode->level;
-  // remove the entry that is pushed up from current node
-  oldNode->keyArray[moveUpIndex] = 0;
-  oldNode->pageNoArray[moveUpIndex] = (PageId) 0;
+  oldNode->numKeys = moveUpIndex;
 
   // insert new entry
-  if (newEntry->key < newNode->keyArray[0])
+  if (newEntry->key < moveUpEntry->key)
     insertNonLeafNode(oldNode, newEntry);
   else
     insertNonLeafNode(newNode, newEntry);
-  newEntry = &moveUpEntry;
+  newEntry = moveUpEntry;
 
-  bufMgr->unPinPage(file, oldPageNumber, true);
-  bufMgr->unPinPage(file, newPageNumber, true);
+  oldPage.markDirty();
+  newPage.markDirty();
+  oldPage.release();
+  newPage.release();
 
   // check if current node is root
   if (oldPageNumber == rootPageNum){
@@ -351,18 +726,18 @@ const void BTreeIndex::splitNonLeafNode(NonLeafNodeInt *oldNode, PageId oldPageN
 
 /**
  * function to split leaf node when the inserted leafNode is full
- * @param leaf            leaf node which need to be splited
- * @param leafPageNumber  page number  of the leaf node
+ * @param leafPage        leaf node which need to be splited, unpinned on return
  * @param newEntry        data entry which need to move up
- * @param dataEntry       data entry which need to be inserted 
+ * @param dataEntry       data entry which need to be inserted
 */
-const void BTreeIndex::splitLeafNode(LeafNodeInt *leaf, PageId leafPageNumber, PageKeyPair<int> *&newEntry, const RIDKeyPair<int> dataEntry)
+const void BTreeIndex::splitLeafNode(PageHandle &leafPage, PageKeyPair<int> *&newEntry, const RIDKeyPair<int> dataEntry)
 {
+  LeafNodeInt *leaf = (LeafNodeInt *)leafPage.get();
+  const PageId leafPageNumber = leafPage.pageNo();
   PageId newPageNumber;
-  Page *newPage;
   // allocate a new node (leaf)
-  bufMgr->allocPage(file, newPageNumber, newPage);
-  LeafNodeInt *newLeafNode = (LeafNodeInt *)newPage;
+  PageHandle newPage = bufMgr->pinNewPage(file, newPageNumber);
+  LeafNodeInt *newLeafNode = (LeafNodeInt *)newPage.get();
 
   // split index
   int mid = leafOccupancy/2;
@@ -373,14 +748,12 @@ const void BTreeIndex::splitLeafNode(LeafNodeInt *leaf, PageId leafPageNumber, P
   }
 
   // move entries to the new node
-  for(int i = mid; i < leafOccupancy; i++)
-  {
-    newLeafNode->keyArray[i-mid] = leaf->keyArray[i];
-    newLeafNode->ridArray[i-mid] = leaf->ridArray[i];
-    leaf->keyArray[i] = 0;
-    leaf->ridArray[i].page_number = 0;
-  }
-  
+  const int numMoved = leafOccupancy - mid;
+  memcpy(newLeafNode->keyArray, &leaf->keyArray[mid], numMoved * sizeof(int));
+  memcpy(newLeafNode->ridArray, &leaf->ridArray[mid], numMoved * sizeof(RecordId));
+  newLeafNode->numKeys = numMoved;
+  leaf->numKeys = mid;
+
   // check where to add the new entry
   if (dataEntry.key > leaf->keyArray[mid-1])
   {
@@ -397,12 +770,12 @@ const void BTreeIndex::splitLeafNode(LeafNodeInt *leaf, PageId leafPageNumber, P
 
   // the smallest key from second page as the new child entry
   newEntry = new PageKeyPair<int>();
-  PageKeyPair<int> newKeyPair;
-  newKeyPair.set(newPageNumber, newLeafNode->keyArray[0]);
-  newEntry = &newKeyPair;
-  
-  bufMgr->unPinPage(file, leafPageNumber, true);
-  bufMgr->unPinPage(file, newPageNumber, true);
+  newEntry->set(newPageNumber, newLeafNode->keyArray[0]);
+
+  leafPage.markDirty();
+  newPage.markDirty();
+  leafPage.release();
+  newPage.release();
 
   // if curr page is root
   if (leafPageNumber == rootPageNum)
@@ -418,30 +791,28 @@ const void BTreeIndex::splitLeafNode(LeafNodeInt *leaf, PageId leafPageNumber, P
 */
 const void BTreeIndex::updateRootNode(PageId firstPage, PageKeyPair<int> *newEntry)
 {
-  
+
   PageId newPageNumber;
-  Page *newRoot;
   // allocate a new root node
-  bufMgr->allocPage(file, newPageNumber, newRoot);
-  NonLeafNodeInt *newRootPage = (NonLeafNodeInt *)newRoot;
+  PageHandle newRoot = bufMgr->pinNewPage(file, newPageNumber);
+  newRoot.markDirty();
+  NonLeafNodeInt *newRootPage = (NonLeafNodeInt *)newRoot.get();
 
   // update metadata
-  if (initialRootPageNum == rootPageNum) 
+  if (initialRootPageNum == rootPageNum)
     newRootPage->level = 1;
   else
     newRootPage->level = 0;
   newRootPage->pageNoArray[0] = firstPage;
   newRootPage->pageNoArray[1] = newEntry->pageNo;
   newRootPage->keyArray[0] = newEntry->key;
+  newRootPage->numKeys = 1;
 
-  Page *metaInfo;
-  bufMgr->readPage(file, headerPageNum, metaInfo);
-  IndexMetaInfo *metaPage = (IndexMetaInfo *)metaInfo;
+  PageHandle metaInfo = bufMgr->pinPage(file, headerPageNum);
+  metaInfo.markDirty();
+  IndexMetaInfo *metaPage = (IndexMetaInfo *)metaInfo.get();
   metaPage->rootPageNo = newPageNumber;
   rootPageNum = newPageNumber;
-  
-  bufMgr->unPinPage(file, headerPageNum, true);
-  bufMgr->unPinPage(file, newPageNumber, true);
 }
 
 // -----------------------------------------------------------------------------
@@ -471,76 +842,45 @@ void BTreeIndex::startScan(const void* lowValParm, const Operator lowOpParm, con
   if (lowValInt > highValInt){
     throw BadScanrangeException();
   }
-  currentPageNum = rootPageNum;
-  bufMgr->readPage(file, currentPageNum, currentPageData);
+  currentPage = bufMgr->pinPage(file, rootPageNum);
 
   //if root is not at leaf position
   if (initialRootPageNum != rootPageNum){
-    NonLeafNodeInt* curPointer = (NonLeafNodeInt*) currentPageData;
+    NonLeafNodeInt* curPointer = (NonLeafNodeInt*) currentPage.get();
     bool nextIsLeaf = false;
     while(!nextIsLeaf){
-      curPointer = (NonLeafNodeInt*) currentPageData;
+      curPointer = (NonLeafNodeInt*) currentPage.get();
       if (curPointer->level == 1){
         nextIsLeaf = true;
       }
       PageId nextPageNum;
       findNextNonLeafNode(curPointer, nextPageNum, lowValInt);
-      bufMgr->unPinPage(file, currentPageNum, false);
+      currentPage.release();
       //find nextpage at below level
-      currentPageNum = nextPageNum;
-      bufMgr->readPage(file, currentPageNum, currentPageData);
+      currentPage = bufMgr->pinPage(file, nextPageNum);
     }
   }
 
-  bool foundSmallest = false;
-  //last rid in this array (rid array is not full)
-  bool noVal = false; 
-  while(!foundSmallest){
-    //這只有看小於lower bound的page是空的
-    LeafNodeInt* curNode = (LeafNodeInt*) currentPageData;
-    if (curNode->ridArray[0].page_number == 0){
-      bufMgr->unPinPage(file, currentPageNum, false);
-      throw NoSuchKeyFoundException();
-    }
-    for (int i = 0; i < leafOccupancy; i++){
-      if (noVal){
-        break;
-      }
-      //iterate to last element in rid array
-      if (i < leafOccupancy - 1 && curNode->ridArray[i + 1].page_number == 0){
-        noVal == true;
-      }
-      int keyValue = curNode->keyArray[i];
-      if (checkKey(lowValInt, lowOp, highValInt,  highOp,  keyValue)){
-        foundSmallest = true;
-        nextEntry = i;
-        scanExecuting = true;
-        break;
-      }
-      else if ((highOpParm == LTE && !(keyValue <= highValInt))){
-        bufMgr->unPinPage(file, currentPageNum, false);
+  // find the first key satisfying the low bound, moving right past leaves whose keys all fall below it
+  while(1){
+    LeafNodeInt* curNode = (LeafNodeInt*) currentPage.get();
+    const int i = keySearch(curNode->keyArray, curNode->numKeys, lowValInt, lowOp == GT);
+    if (i < curNode->numKeys){
+      if (!checkKey(lowValInt, lowOp, highValInt, highOp, curNode->keyArray[i])){
+        currentPage.release();
         throw NoSuchKeyFoundException();
       }
-      else if ((highOpParm == LT && !(keyValue < highValInt))){
-        bufMgr->unPinPage(file, currentPageNum, false);
-        throw NoSuchKeyFoundException();        
-      }
-      else {
-      // keyValue < lowOpParm -> continue do for loop
-
-        // (1) rid array is full, iterate all and no match 
-        // (2) rid array is not full, iterate all and no match
-        if (i == leafOccupancy - 1 || noVal){
-          bufMgr->unPinPage(file, currentPageNum, false);
-          int sibNo = curNode->rightSibPageNo;
-          if (sibNo == 0){
-            throw NoSuchKeyFoundException();
-          }
-          currentPageNum = sibNo;
-          bufMgr->readPage(file, currentPageNum, currentPageData);
-        } 
-      }
+      nextEntry = i;
+      scanExecuting = true;
+      return;
+    }
+
+    const PageId sibNo = curNode->rightSibPageNo;
+    currentPage.release();
+    if (sibNo == 0){
+      throw NoSuchKeyFoundException();
     }
+    currentPage = bufMgr->pinPage(file, sibNo);
   }
 }
 
@@ -557,15 +897,16 @@ void BTreeIndex::scanNext(RecordId& outRid)
   if (!scanExecuting){
     throw ScanNotInitializedException();
   }
-  LeafNodeInt* curNode = (LeafNodeInt*) currentPageData;
-  if (nextEntry == leafOccupancy || curNode->ridArray[nextEntry].page_number == 0){
-    bufMgr->unPinPage(file, currentPageNum, false);
+  LeafNodeInt* curNode = (LeafNodeInt*) currentPage.get();
+  if (nextEntry == curNode->numKeys){
+    // the last leaf stays pinned until endScan
     if (curNode->rightSibPageNo == 0){
       throw IndexScanCompletedException();
     }
-    currentPageNum = curNode->rightSibPageNo;
-    bufMgr->readPage(file, currentPageNum, currentPageData);
-    curNode = (LeafNodeInt*) currentPageData;
+    const PageId sibNo = curNode->rightSibPageNo;
+    currentPage.release();
+    currentPage = bufMgr->pinPage(file, sibNo);
+    curNode = (LeafNodeInt*) currentPage.get();
     nextEntry = 0;
   }
   int keyValue = curNode->keyArray[nextEntry];
@@ -591,7 +932,7 @@ void BTreeIndex::endScan()
   if (!scanExecuting){
     throw ScanNotInitializedException();
   }
-  bufMgr->unPinPage(file, currentPageNum, false);
+  currentPage.release();
   scanExecuting = false;
 }
 
@@ -11,6 +11,7 @@
 #include <string>
 #include "string.h"
 #include <sstream>
+#include <vector>
 
 #include "types.h"
 #include "page.h"
@@ -30,6 +31,13 @@ enum Datatype
   STRING = 2
 };
 
+/**
+ * @brief Default fraction of key slots filled in each node by the bulk-load path.
+ * Nodes keep some room so that the first inserts after a bulk load do not
+ * split them; 1.0 packs them full, for indexes that are only read.
+ */
+const double BULKLOAD_FILLFACTOR = 0.9;
+
 /**
  * @brief Scan operations enumeration. Passed to BTreeIndex::startScan() method.
  */
@@ -45,14 +53,20 @@ enum Operator
 /**
  * @brief Number of key slots in B+Tree leaf for INTEGER key.
  */
-//                                                  sibling ptr             key               rid
-const  int INTARRAYLEAFSIZE = ( Page::SIZE - sizeof( PageId ) ) / ( sizeof( int ) + sizeof( RecordId ) );
+//                                                  numKeys         sibling ptr             key               rid
+const  int INTARRAYLEAFSIZE = ( Page::SIZE - sizeof( int ) - sizeof( PageId ) ) / ( sizeof( int ) + sizeof( RecordId ) );
 
 /**
  * @brief Number of key slots in B+Tree non-leaf for INTEGER key.
  */
-//                                                     level     extra pageNo                  key       pageNo
-const  int INTARRAYNONLEAFSIZE = ( Page::SIZE - sizeof( int ) - sizeof( PageId ) ) / ( sizeof( int ) + sizeof( PageId ) );
+//                                                     level, numKeys     extra pageNo                  key       pageNo
+const  int INTARRAYNONLEAFSIZE = ( Page::SIZE - 2 * sizeof( int ) - sizeof( PageId ) ) / ( sizeof( int ) + sizeof( PageId ) );
+
+/**
+ * @brief Version of the on-disk index layout, stored in the meta page. Indexes written with a
+ * different layout are rejected when opened.
+ */
+const  int INDEXFORMATVERSION = 1;
 
 /**
  * @brief Structure to store a key-rid pair. It is used to pass the pair to functions that 
@@ -128,6 +142,11 @@ struct IndexMetaInfo{
    * Page number of root page of the B+ Tree inside the file index file.
    */
   PageId rootPageNo;
+
+  /**
+   * Layout version of the index file, INDEXFORMATVERSION when written by this code.
+   */
+  int formatVersion;
 };
 
 /*
@@ -146,6 +165,11 @@ struct NonLeafNodeInt{
    */
   int level;
 
+  /**
+   * Number of keys in use. The node has numKeys + 1 children.
+   */
+  int numKeys;
+
   /**
    * Stores keys.
    */
@@ -162,6 +186,11 @@ struct NonLeafNodeInt{
  * @brief Structure for all leaf nodes when the key is of INTEGER type.
 */
 struct LeafNodeInt{
+  /**
+   * Number of key-rid pairs in use.
+   */
+  int numKeys;
+
   /**
    * Stores keys.
    */
@@ -242,14 +271,9 @@ class BTreeIndex {
   int     nextEntry;
 
   /**
-   * Page number of current page being scanned.
-   */
-  PageId  currentPageNum;
-
-  /**
-   * Current Page being scanned.
+   * Current page being scanned, held pinned until the scan moves past it or ends.
    */
-  Page    *currentPageData;
+  PageHandle currentPage;
 
   /**
    * Low INTEGER value for scan.
@@ -305,9 +329,13 @@ class BTreeIndex {
    * @param bufMgrIn            Buffer Manager Instance
    * @param attrByteOffset      Offset of attribute, over which index is to be built, in the record
    * @param attrType            Datatype of attribute over which index is built
+   * @param bulkLoad            If true, a new index is built bottom-up from the sorted keys of the
+   *                            relation instead of inserting every tuple through insertEntry.
+   * @param fillFactor          Fraction (0, 1] of key slots filled in each node by the bulk-load path.
    */
   BTreeIndex(const std::string & relationName, std::string & outIndexName,
-            BufMgr *bufMgrIn, const int attrByteOffset, const Datatype attrType);
+            BufMgr *bufMgrIn, const int attrByteOffset, const Datatype attrType,
+            const bool bulkLoad = false, const double fillFactor = BULKLOAD_FILLFACTOR);
   
 
   /**
@@ -373,15 +401,33 @@ class BTreeIndex {
 
   const void updateRootNode(PageId firstPageInRoot, PageKeyPair<int> *newEntry);
 
-  const void splitLeafNode(LeafNodeInt *leaf, PageId leafPageNum, PageKeyPair<int> *&newEntry, const RIDKeyPair<int> dataEntry);
+  const void splitLeafNode(PageHandle &leafPage, PageKeyPair<int> *&newEntry, const RIDKeyPair<int> dataEntry);
 
-  const void splitNonLeafNode(NonLeafNodeInt *oldNode, PageId oldPageNumber, PageKeyPair<int> *&newEntry);
+  const void splitNonLeafNode(PageHandle &oldPage, PageKeyPair<int> *&newEntry);
 
-  const void insert(Page *curPage, PageId curPageNum, bool nodeIsLeaf, const RIDKeyPair<int> dataEntry, PageKeyPair<int> *&newEntry);
+  const void insert(PageHandle &curPage, bool nodeIsLeaf, const RIDKeyPair<int> dataEntry, PageKeyPair<int> *&newEntry);
 
   const void findNextNonLeafNode(NonLeafNodeInt *curNode, PageId &nextNodeNum, int key);
 
   const bool checkIfValid(int highVal, int lowVal, const Operator highOperator, const Operator lowOperator, int keyValue);
+
+  /**
+   * Build the index bottom-up. All (key, rid) pairs of the relation are extracted with a FileScan and
+   * sorted, spilling sorted runs to a temporary file whenever they exceed the size of the buffer pool,
+   * then packed into leaves left to right which are finally topped with non-leaf levels.
+   * @param relationName  Name of the base relation
+   * @param fillFactor    Fraction of key slots filled in each node
+   */
+  const void bulkLoad(const std::string &relationName, const double fillFactor);
+
+  /**
+   * Pack one level of non-leaf nodes over the given children and repeat for the levels above
+   * until a single root remains. The meta page is updated to point to the new root.
+   * @param children          First key and page number of every node on the level below, left to right
+   * @param childrenAreLeaves True if the level below is the leaf level
+   * @param fillFactor        Fraction of key slots filled in each node
+   */
+  const void bulkLoadNonLeafLevels(std::vector<PageKeyPair<int> > &children, bool childrenAreLeaves, const double fillFactor);
 };
 
 }
\ No newline at end of file
@@ -7,6 +7,8 @@
 
 #include <memory>
 #include <iostream>
+#include <new>
+#include <stdlib.h>
 #include "buffer.h"
 #include "bufHashTbl.h"
 #include "exceptions/hash_already_present_exception.h"
@@ -15,100 +17,160 @@
 
 namespace badgerdb {
 
-int BufHashTbl::hash(const File* file, const PageId pageNo)
+std::uint64_t BufHashTbl::hash(std::uint64_t key)
 {
-  int tmp, value;
-  tmp = (long)file;  // cast of pointer to the file object to an integer
-  value = (tmp + pageNo) % HTSIZE;
-  return value;
+  // splitmix64 finalizer, spreads consecutive page numbers of a file over the table
+  key ^= key >> 30;
+  key *= 0xbf58476d1ce4e5b9ULL;
+  key ^= key >> 27;
+  key *= 0x94d049bb133111ebULL;
+  key ^= key >> 31;
+  return key;
 }
 
 BufHashTbl::BufHashTbl(int htSize)
-	: HTSIZE(htSize)
+	: numPartitions(1), numBuckets(1)
 {
-  // allocate an array of pointers to hashBuckets
-  ht = new hashBucket* [htSize];
-  for(int i=0; i < HTSIZE; i++)
-    ht[i] = NULL;
+  // small tables are not partitioned, so that a skewed hash cannot fill up a partition
+  while (numPartitions < HASHPARTITIONS && numPartitions * 64 <= (std::size_t)htSize)
+    numPartitions *= 2;
+
+  // keep at least twice as many slots as entries so probe sequences stay short
+  while (numPartitions * numBuckets * HASHBUCKETSLOTS < 2 * (std::size_t)htSize)
+    numBuckets *= 2;
+  numSlots = numBuckets * HASHBUCKETSLOTS;
+
+  // allocate cache line aligned buckets
+  const std::size_t totalBuckets = numPartitions * numBuckets;
+  void* mem = NULL;
+  if (posix_memalign(&mem, sizeof(hashBucket), totalBuckets * sizeof(hashBucket)) != 0)
+    throw std::bad_alloc();
+  ht = static_cast<hashBucket*>(mem);
+  for (std::size_t i = 0; i < totalBuckets; i++) {
+    new (&ht[i]) hashBucket;
+    for (int j = 0; j < HASHBUCKETSLOTS; j++) {
+      ht[i].key[j].store(EMPTY_KEY, std::memory_order_relaxed);
+      ht[i].frameNo[j].store(0, std::memory_order_relaxed);
+    }
+  }
+
+  partitions = new hashPartition[numPartitions];
+  for (std::size_t i = 0; i < numPartitions; i++)
+    partitions[i].version.store(0, std::memory_order_relaxed);
 }
 
 BufHashTbl::~BufHashTbl()
 {
-  for(int i = 0; i < HTSIZE; i++) {
-    hashBucket* tmpBuf = ht[i];
-    while (ht[i]) {
-      tmpBuf = ht[i];
-      ht[i] = ht[i]->next;
-      delete tmpBuf;
+  for (std::size_t i = 0; i < numPartitions * numBuckets; i++)
+    ht[i].~hashBucket();
+  free(ht);
+  delete [] partitions;
+}
+
+bool BufHashTbl::findSlot(const std::uint64_t key, const std::uint64_t hashValue, std::size_t &slot) const
+{
+  const std::size_t partition = partitionOf(hashValue);
+  std::size_t index = homeSlot(hashValue);
+  for (std::size_t probes = 0; probes < numSlots; probes++) {
+    const std::uint64_t slotKeyVal = slotKey(partition, index).load(std::memory_order_relaxed);
+    if (slotKeyVal == key) {
+      slot = index;
+      return true;
     }
+    if (slotKeyVal == EMPTY_KEY)
+      return false;
+    index = (index + 1) % numSlots;
   }
-  delete [] ht;
+  return false;
 }
 
 void BufHashTbl::insert(const File* file, const PageId pageNo, const FrameId frameNo)
 {
-  int index = hash(file, pageNo);
-
-  hashBucket* tmpBuc = ht[index];
-  while (tmpBuc) {
-    if (tmpBuc->file == file && tmpBuc->pageNo == pageNo)
-  		throw HashAlreadyPresentException(tmpBuc->file->filename(), tmpBuc->pageNo, tmpBuc->frameNo);
-    tmpBuc = tmpBuc->next;
+  const std::uint64_t key = makeKey(file, pageNo);
+  const std::uint64_t hashValue = hash(key);
+  const std::size_t partition = partitionOf(hashValue);
+  std::size_t index = homeSlot(hashValue);
+  std::size_t probes = 0;
+
+  while (slotKey(partition, index).load(std::memory_order_relaxed) != EMPTY_KEY) {
+    if (slotKey(partition, index).load(std::memory_order_relaxed) == key)
+      throw HashAlreadyPresentException(file->filename(), pageNo,
+                                        slotFrame(partition, index).load(std::memory_order_relaxed));
+    if (++probes == numSlots)
+      throw HashTableException();
+    index = (index + 1) % numSlots;
   }
 
-  tmpBuc = new hashBucket;
-  if (!tmpBuc)
-  	throw HashTableException();
-
-  tmpBuc->file = (File*) file;
-  tmpBuc->pageNo = pageNo;
-  tmpBuc->frameNo = frameNo;
-  tmpBuc->next = ht[index];
-  ht[index] = tmpBuc;
+  std::atomic<std::uint64_t>& version = partitions[partition].version;
+  version.fetch_add(1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  slotFrame(partition, index).store(frameNo, std::memory_order_relaxed);
+  slotKey(partition, index).store(key, std::memory_order_relaxed);
+  version.fetch_add(1, std::memory_order_release);
 }
 
-void BufHashTbl::lookup(const File* file, const PageId pageNo, FrameId &frameNo) 
+bool BufHashTbl::find(const File* file, const PageId pageNo, FrameId &frameNo) const
 {
-  int index = hash(file, pageNo);
-  hashBucket* tmpBuc = ht[index];
-  while (tmpBuc) {
-    if (tmpBuc->file == file && tmpBuc->pageNo == pageNo)
-    {
-      frameNo = tmpBuc->frameNo; // return frameNo by reference
-      return;
+  const std::uint64_t key = makeKey(file, pageNo);
+  const std::uint64_t hashValue = hash(key);
+  const std::size_t partition = partitionOf(hashValue);
+  const std::atomic<std::uint64_t>& version = partitions[partition].version;
+  while (true) {
+    const std::uint64_t before = version.load(std::memory_order_acquire);
+    std::size_t slot = 0;
+    const bool found = findSlot(key, hashValue, slot);
+    const FrameId frame = found ? slotFrame(partition, slot).load(std::memory_order_relaxed) : 0;
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    // retry if an update was in progress or happened while probing
+    if ((before & 1) == 0 && version.load(std::memory_order_relaxed) == before) {
+      if (found)
+        frameNo = frame; // return frameNo by reference
+      return found;
     }
-    tmpBuc = tmpBuc->next;
   }
+}
 
-  throw HashNotFoundException(file->filename(), pageNo);
+void BufHashTbl::lookup(const File* file, const PageId pageNo, FrameId &frameNo) const
+{
+  if (!find(file, pageNo, frameNo))
+    throw HashNotFoundException(file->filename(), pageNo);
 }
 
 void BufHashTbl::remove(const File* file, const PageId pageNo) {
 
-  int index = hash(file, pageNo);
-  hashBucket* tmpBuc = ht[index];
-  hashBucket* prevBuc = NULL;
-
-  while (tmpBuc)
-	{
-    if (tmpBuc->file == file && tmpBuc->pageNo == pageNo)
-		{
-      if(prevBuc) 
-				prevBuc->next = tmpBuc->next;
-      else
-				ht[index] = tmpBuc->next;
-
-      delete tmpBuc;
-      return;
-    }
-		else
-		{
-      prevBuc = tmpBuc;
-      tmpBuc = tmpBuc->next;
+  const std::uint64_t hashValue = hash(makeKey(file, pageNo));
+  const std::size_t partition = partitionOf(hashValue);
+  std::size_t hole = 0;
+  if (!findSlot(makeKey(file, pageNo), hashValue, hole))
+    throw HashNotFoundException(file->filename(), pageNo);
+
+  std::atomic<std::uint64_t>& version = partitions[partition].version;
+  version.fetch_add(1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  // Shift later entries of the probe sequence back into the hole, so that no
+  // entry ends up separated from its home slot by an empty slot.
+  std::size_t index = hole;
+  for (std::size_t probes = 1; probes < numSlots; probes++) {
+    index = (index + 1) % numSlots;
+    const std::uint64_t key = slotKey(partition, index).load(std::memory_order_relaxed);
+    if (key == EMPTY_KEY)
+      break;
+    const std::size_t home = homeSlot(hash(key));
+    // the entry stays if its home lies cyclically in (hole, index]
+    const bool stays = (hole <= index) ? (hole < home && home <= index)
+                                       : (hole < home || home <= index);
+    if (!stays) {
+      slotFrame(partition, hole).store(slotFrame(partition, index).load(std::memory_order_relaxed),
+                                       std::memory_order_relaxed);
+      slotKey(partition, hole).store(key, std::memory_order_relaxed);
+      hole = index;
     }
   }
+  slotKey(partition, hole).store(EMPTY_KEY, std::memory_order_relaxed);
 
-  throw HashNotFoundException(file->filename(), pageNo);
+  version.fetch_add(1, std::memory_order_release);
 }
 
 }
@@ -7,65 +7,174 @@
 
 #pragma once
 
+#include <atomic>
+#include <cstdint>
+#include <mutex>
 #include "file.h"
 
 namespace badgerdb {
 
+/**
+ * @brief Number of slots in one hash bucket.
+ */
+const int HASHBUCKETSLOTS = 5;
+
 /**
 * @brief Declarations for buffer pool hash table
+*
+* A bucket is one cache line of slots.  Each slot maps a key, made of the file
+* id and the page number, to a frame.  Slots are atomics so that lookups can
+* read them while an update is in progress.
 */
-struct hashBucket {
+struct alignas(64) hashBucket {
 	/**
-	 * pointer a file object (more on this below)
+	 * (file id, page number) key of each slot, or EMPTY_KEY
 	 */
-	File *file;
+	std::atomic<std::uint64_t> key[HASHBUCKETSLOTS];
 
 	/**
-	 * page number within a file
+	 * frame number of page in the buffer pool
 	 */
-	PageId pageNo;
+	std::atomic<FrameId> frameNo[HASHBUCKETSLOTS];
+};
+
+static_assert(sizeof(hashBucket) == 64, "A hash bucket must fill exactly one cache line.");
 
+/**
+ * @brief Maximum number of partitions of the buffer pool hash table.
+ */
+const int HASHPARTITIONS = 16;
+
+/**
+* @brief Independently latched part of the buffer pool hash table. Every key
+* hashes to one partition and is probed for within its buckets only.
+*/
+struct hashPartition {
 	/**
-	 * frame number of page in the buffer pool
+	 * Held by the buffer manager while it updates the partition
 	 */
-	FrameId frameNo;
+	std::mutex latch;
 
 	/**
-	 * Next node in the hash table
+	 * Incremented before and after every update, odd while an update is in progress
 	 */
-	hashBucket*   next;
+	std::atomic<std::uint64_t> version;
 };
 
 
 /**
 * @brief Hash table class to keep track of pages in the buffer pool
 *
-* @warning This class is not threadsafe.
+* Open addressing table with linear probing over the slots of consecutive
+* buckets and backward-shift deletion, so removals leave no tombstones behind.
+* The table is split into partitions.  Lookups take no lock and never
+* allocate: they read the slots optimistically and retry if the version
+* counter of the partition shows that an update ran meanwhile.
+*
+* @warning Updates (insert and remove) must be made while holding the latch
+* of the partition of the key, see partitionLatch().
 */
 class BufHashTbl
 {
  private:
 	/**
-	 *	Size of Hash Table
+	 * Key of a slot holding no entry.  File ids start at 1 so no valid key is 0.
 	 */
-  int HTSIZE;
+	static const std::uint64_t EMPTY_KEY = 0;
+
 	/**
-	 * Actual Hash table object
+	 *	Number of partitions, a power of two
 	 */
-  hashBucket**  ht;
+  std::size_t numPartitions;
 
 	/**
-	 * returns hash value between 0 and HTSIZE-1 computed using file and pageNo
+	 *	Number of buckets in each partition, a power of two
+	 */
+  std::size_t numBuckets;
+
+	/**
+	 *	Number of slots in each partition
+	 */
+  std::size_t numSlots;
+
+	/**
+	 * Actual Hash table object, the buckets of all partitions one after the other
+	 */
+  hashBucket*  ht;
+
+	/**
+	 * Latch and version counter of every partition
+	 */
+  hashPartition* partitions;
+
+	/**
+	 * Builds the key of a page from the id of its file and its number.
 	 *
 	 * @param file   	File object
 	 * @param pageNo  Page number in the file
+	 * @return  			Key
+	 */
+  static std::uint64_t makeKey(const File* file, const PageId pageNo)
+  {
+		return ((std::uint64_t)file->id() << 32) | pageNo;
+  }
+
+	/**
+	 * returns a mixing hash of a key; the high bits select the partition and
+	 * the low bits the home slot within it
+	 *
+	 * @param key   	Key of the page
 	 * @return  			Hash value.
 	 */
-  int	 hash(const File* file, const PageId pageNo);
+  static std::uint64_t hash(std::uint64_t key);
+
+	/**
+	 * Partition of a hash value, between 0 and numPartitions-1
+	 */
+  std::size_t partitionOf(const std::uint64_t hashValue) const
+  {
+		return (hashValue >> 40) & (numPartitions - 1);
+  }
+
+	/**
+	 * Home slot of a hash value within its partition, between 0 and numSlots-1
+	 */
+  std::size_t homeSlot(const std::uint64_t hashValue) const
+  {
+		return (hashValue & (numBuckets - 1)) * HASHBUCKETSLOTS;
+  }
+
+	/**
+	 * Atomic slot holding the key of the given slot number of a partition
+	 */
+  std::atomic<std::uint64_t>& slotKey(const std::size_t partition, const std::size_t slot) const
+  {
+		return ht[partition * numBuckets + slot / HASHBUCKETSLOTS].key[slot % HASHBUCKETSLOTS];
+  }
+
+	/**
+	 * Atomic slot holding the frame of the given slot number of a partition
+	 */
+  std::atomic<FrameId>& slotFrame(const std::size_t partition, const std::size_t slot) const
+  {
+		return ht[partition * numBuckets + slot / HASHBUCKETSLOTS].frameNo[slot % HASHBUCKETSLOTS];
+  }
+
+	/**
+	 * Finds the slot holding the given key.
+	 *
+	 * @param key   	Key of the page
+	 * @param hashValue Hash of the key
+	 * @param slot  	Slot number within the partition of the key returned via this reference
+	 * @return  			True if the key is present
+	 */
+  bool findSlot(const std::uint64_t key, const std::uint64_t hashValue, std::size_t &slot) const;
 
  public:
 	/**
    * Constructor of BufHashTbl class
+   *
+   * @param htSize  Expected number of entries; the table is sized to keep the load low
 	 */
 	BufHashTbl(const int htSize);  // constructor
 
@@ -73,7 +182,31 @@ class BufHashTbl
    * Destructor of BufHashTbl class
 	 */
   ~BufHashTbl(); // destructor
-	
+
+	/**
+   * Returns the partition that (file, pageNo) belongs to.
+	 *
+	 * @param file   	File object
+	 * @param pageNo 	Page number in the file
+	 * @return  			Partition number
+	 */
+  std::size_t partition(const File* file, const PageId pageNo) const
+  {
+		return partitionOf(hash(makeKey(file, pageNo)));
+  }
+
+	/**
+   * Returns the latch that must be held to insert or remove entries of a
+   * partition.
+	 *
+	 * @param partition  Partition number
+	 * @return  			Latch of the partition
+	 */
+  std::mutex& partitionLatch(const std::size_t partition)
+  {
+		return partitions[partition].latch;
+  }
+
 	/**
    * Insert entry into hash table mapping (file, pageNo) to frameNo.
 	 *
@@ -81,29 +214,41 @@ class BufHashTbl
 	 * @param pageNo 	Page number in the file
 	 * @param frameNo Frame number assigned to that page of the file
    * @throws  HashAlreadyPresentException	if the corresponding page already exists in the hash table
-   * @throws  HashTableException (optional) if could not create a new bucket as running of memory
+   * @throws  HashTableException if the table has no free slot left
 	 */
   void insert(const File* file, const PageId pageNo, const FrameId frameNo);
 
 	/**
    * Check if (file, pageNo) is currently in the buffer pool (ie. in
+   * the hash table).  A miss is an ordinary outcome here and is reported
+   * through the return value rather than an exception.
+	 *
+	 * @param file  	File object
+	 * @param pageNo	Page number in the file
+	 * @param frameNo Frame number reference, set only if the page is found
+	 * @return  			True if the page entry is in the hash table
+	 */
+  bool find(const File* file, const PageId pageNo, FrameId &frameNo) const;
+
+	/**
+   * Check if (file, pageNo) is currently in the buffer pool (ie. in
    * the hash table).
 	 *
 	 * @param file  	File object
 	 * @param pageNo	Page number in the file
 	 * @param frameNo Frame number reference
-   * @throws HashNotFoundException if the page entry is not found in the hash table 
+   * @throws HashNotFoundException if the page entry is not found in the hash table
 	 */
-  void lookup(const File* file, const PageId pageNo, FrameId &frameNo);
+  void lookup(const File* file, const PageId pageNo, FrameId &frameNo) const;
 
 	/**
    * Delete entry (file,pageNo) from hash table.
 	 *
 	 * @param file   	File object
 	 * @param pageNo  Page number in the file
-   * @throws HashNotFoundException if the page entry is not found in the hash table 
+   * @throws HashNotFoundException if the page entry is not found in the hash table
 	 */
-  void remove(const File* file, const PageId pageNo);  
+  void remove(const File* file, const PageId pageNo);
 };
 
 }
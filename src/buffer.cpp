@@ -5,14 +5,21 @@
  * Copyright (c) 2012 Database Group, Computer Sciences Department, University of Wisconsin-Madison.
  */
 
+#include <algorithm>
 #include <memory>
+#include <fstream>
 #include <iostream>
+#include <new>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
 #include "buffer.h"
 #include "exceptions/buffer_exceeded_exception.h"
 #include "exceptions/page_not_pinned_exception.h"
 #include "exceptions/page_pinned_exception.h"
 #include "exceptions/bad_buffer_exception.h"
-#include "exceptions/hash_not_found_exception.h"
+#include "exceptions/badgerdb_exception.h"
 
 namespace badgerdb { 
 
@@ -20,168 +27,772 @@ namespace badgerdb {
 // Constructor of the class BufMgr
 //----------------------------------------
 
-BufMgr::BufMgr(std::uint32_t bufs)
-	: numBufs(bufs) {
+/**
+ * Size of the huge pages the pool is rounded up to.
+ */
+static const std::size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+static_assert(Page::SIZE % 4096 == 0, "Frames must stay aligned to memory pages.");
+
+/**
+ * Number of NUMA nodes a node mask passed to mbind() can hold.
+ */
+static const std::size_t MAX_NODES = 1024;
+
+/**
+ * Sets the bits of the NUMA nodes that are online in the given mask, as
+ * listed by the kernel in ranges such as "0-1,3".
+ *
+ * @param nodeMask  Mask of MAX_NODES bits, cleared by the caller
+ * @return          False if the list of online nodes cannot be read
+ */
+static bool readOnlineNodes(unsigned long* nodeMask)
+{
+  const std::size_t wordBits = 8 * sizeof(unsigned long);
+  std::ifstream online("/sys/devices/system/node/online");
+  std::size_t first;
+  bool any = false;
+  while (online >> first)
+  {
+    std::size_t last = first;
+    if (online.peek() == '-')
+    {
+      online.get();
+      if (!(online >> last))
+        return false;
+    }
+    for (std::size_t node = first; node <= last && node < MAX_NODES; node++)
+      nodeMask[node / wordBits] |= 1UL << (node % wordBits);
+    any = true;
+    if (online.peek() == ',')
+      online.get();
+  }
+  return any;
+}
+
+BufMgr::BufMgr(std::uint32_t bufs, ReplacementPolicy *replacementPolicy, const BufMgrConfig& config)
+	: numBufs(bufs), policy(replacementPolicy), dirtyFrames(NO_FRAME), lastDirtyFrame(NO_FRAME), numDirty(0),
+	  prefetchInFlight(NULL), prefetchStop(false), writerStop(false) {
 	bufDescTable = new BufDesc[bufs];
 
+  frameState = new std::atomic<std::uint32_t>[bufs];
+  frameFreeSpace = new std::atomic<std::uint8_t>[bufs];
+
   for (FrameId i = 0; i < bufs; i++) 
   {
   	bufDescTable[i].frameNo = i;
-  	bufDescTable[i].valid = false;
+  	frameState[i].store(0, std::memory_order_relaxed);
+  	frameFreeSpace[i].store(0, std::memory_order_relaxed);
   }
 
-  bufPool = new Page[bufs];
+  allocPool(config);
 
   int htsize = ((((int) (bufs * 1.2))*2)/2)+1;
   hashTable = new BufHashTbl (htsize);  // allocate the buffer hash table
 
-  clockHand = bufs - 1;
+  if (policy == NULL)
+    policy = new ClockPolicy(bufs);
 }
 
 
 BufMgr::~BufMgr() {
+  // stop the prefetch thread, dropping what it has not read yet
+  {
+    std::lock_guard<std::mutex> prefetchGuard(prefetchLatch);
+    prefetchStop = true;
+    prefetchQueue.clear();
+  }
+  prefetchCond.notify_all();
+  if (prefetcher.joinable())
+    prefetcher.join();
+  stopBackgroundWriter();
+
   //Flush out all unwritten pages
-  for (std::uint32_t i = 0; i < numBufs; i++) 
+  for (FrameId i = dirtyFrames; i != NO_FRAME; i = bufDescTable[i].dirtyNext) 
   {
   	BufDesc* tmpbuf = &(bufDescTable[i]);
-  	if (tmpbuf->valid == true && tmpbuf->dirty == true)
+  	if ((frameState[i].load() & (FRAME_VALID | FRAME_DIRTY)) == (FRAME_VALID | FRAME_DIRTY))
 		{
 			tmpbuf->file->writePage(tmpbuf->pageNo, bufPool[i]);
   	}
   }
 
 	delete hashTable;
+  delete policy;
   delete [] bufDescTable;
-  delete [] bufPool;
+  delete [] frameState;
+  delete [] frameFreeSpace;
+  munmap(bufPool, poolSize);
+}
+
+void BufMgr::allocPool(const BufMgrConfig& config)
+{
+  // huge pages are only used for whole huge pages, so round up to them
+  const std::size_t pageSize = (config.pages == SMALL_PAGES) ? (std::size_t)sysconf(_SC_PAGESIZE) : HUGE_PAGE_SIZE;
+  poolSize = ((std::size_t)numBufs * sizeof(Page) + pageSize - 1) / pageSize * pageSize;
+  if (poolSize == 0)
+    poolSize = pageSize;
+
+  void* mem = MAP_FAILED;
+  if (config.pages == EXPLICIT_HUGE_PAGES)
+    mem = mmap(NULL, poolSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (mem == MAP_FAILED)
+  {
+    mem = mmap(NULL, poolSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+      throw std::bad_alloc();
+    if (config.pages != SMALL_PAGES)
+      madvise(mem, poolSize, MADV_HUGEPAGE);
+  }
+
+  // set the NUMA policy before the frames are touched.  The kernel rejects
+  // masks naming nodes it does not know, so only online nodes are named; if
+  // the policy cannot be set the pool keeps the default placement.
+  poolPlacement = DEFAULT_PLACEMENT;
+  if (config.placement != DEFAULT_PLACEMENT)
+  {
+    const std::size_t wordBits = 8 * sizeof(unsigned long);
+    unsigned long onlineMask[MAX_NODES / (8 * sizeof(unsigned long))] = {0};
+    unsigned long nodeMask[MAX_NODES / (8 * sizeof(unsigned long))] = {0};
+    int mode = MPOL_DEFAULT;
+    if (readOnlineNodes(onlineMask))
+    {
+      if (config.placement == INTERLEAVED_PLACEMENT)
+      {
+        mode = MPOL_INTERLEAVE;
+        std::copy(onlineMask, onlineMask + MAX_NODES / wordBits, nodeMask);
+      }
+      else if (config.node >= 0 && (std::size_t)config.node < MAX_NODES
+               && (onlineMask[config.node / wordBits] & (1UL << (config.node % wordBits))))
+      {
+        mode = MPOL_PREFERRED;
+        nodeMask[config.node / wordBits] = 1UL << (config.node % wordBits);
+      }
+    }
+    if (mode != MPOL_DEFAULT
+        && syscall(SYS_mbind, mem, poolSize, mode, nodeMask, MAX_NODES + 1, 0) == 0)
+      poolPlacement = config.placement;
+  }
+
+  bufPool = static_cast<Page*>(mem);
+  for (std::uint32_t i = 0; i < numBufs; i++)
+    new (&bufPool[i]) Page();
 }
 
-void BufMgr::allocBuf(FrameId & frame) 
+void BufMgr::allocBuf(FrameId & frame, const std::size_t heldPartition) 
 {
-  // perform first part of clock algorithm to search for 
-  // open buffer frame
-  // Assumes non-concurrent access to buffer manager
+  // search for an open buffer frame in the order given by the replacement
+  // policy.  Only the state words are read until a victim is found; frames
+  // busy with another thread are skipped rather than waited for.
+  const std::uint32_t scanLimit = policy->scanLimit();
   std::uint32_t numScanned = 0;
-  bool found = 0;
 
-  while (numScanned < 2*numBufs)	//Need to scn twice
+  while (numScanned < scanLimit)
   {
-    // advance the clock
-    advanceClock();
+    const FrameId hand = policy->nextCandidate();
     numScanned++;
 
-    // if invalid, use frame
-    if (! bufDescTable[clockHand].valid)
-    {
-      break;
-    }
+    std::atomic<std::uint32_t>& state = frameState[hand];
+    std::uint32_t frameBits = state.load(std::memory_order_acquire);
 
-    // is valid, check referenced bit
-    if (! bufDescTable[clockHand].refbit)
+    // pinned, or reserved by another thread
+    if (frameBits & FRAME_PINS)
+      continue;
+
+    // if invalid, reserve and use frame
+    if (!(frameBits & FRAME_VALID))
     {
-      // check to see if someone has it pinned
-      if (bufDescTable[clockHand].pinCnt == 0)
-      {
-        // hasn't been referenced and is not pinned, use it
-        // remove previous entry from hash table
-        hashTable->remove(bufDescTable[clockHand].file, bufDescTable[clockHand].pageNo);
-        found = true;
-        break;
-      }
+      if (!state.compare_exchange_strong(frameBits, FRAME_RESERVED, std::memory_order_acquire))
+        continue;
+      frame = hand;
+      return;
     }
-    else
+
+    // is valid, let the policy decide looking at the referenced bit, which is cleared
+    const bool referenced = (frameBits & FRAME_REFERENCED) != 0;
+    if (referenced)
     {
-      // has been referenced, clear the bit
       bufStats.accesses++;
-      bufDescTable[clockHand].refbit = false;
+      state.fetch_and(~FRAME_REFERENCED, std::memory_order_relaxed);
     }
+    if (!policy->evict(hand, referenced))
+      continue;
+
+    // not pinned and chosen for eviction, use it
+    std::unique_lock<std::mutex> frameGuard(bufDescTable[hand].latch, std::try_to_lock);
+    if (!frameGuard.owns_lock() || !evictFrame(hand, heldPartition))
+      continue;
+    policy->frameEvicted(hand);
+
+    // return new frame number
+    frame = hand;
+    return;
   }
-  
-  // check for full buffer pool
-  if (!found && numScanned >= 2*numBufs)
+
+  // full buffer pool
+  throw BufferExceededException();
+} // end allocBuf
+
+
+bool BufMgr::evictFrame(const FrameId frameNo, const std::size_t heldPartition)
+{
+  BufDesc* tmpbuf = &(bufDescTable[frameNo]);
+  std::atomic<std::uint32_t>& state = frameState[frameNo];
+  std::uint32_t frameBits = state.load(std::memory_order_acquire);
+  if ((frameBits & FRAME_PINS) || !(frameBits & FRAME_VALID))
+    return false;
+
+  // Removing the previous entry from the hash table needs the latch of its partition.
+  const std::size_t victimPartition = hashTable->partition(tmpbuf->file, tmpbuf->pageNo);
+  std::unique_lock<std::mutex> partitionGuard;
+  if (victimPartition != heldPartition)
   {
-    throw BufferExceededException();
+    partitionGuard = std::unique_lock<std::mutex>(hashTable->partitionLatch(victimPartition), std::try_to_lock);
+    if (!partitionGuard.owns_lock())
+      return false;
   }
-  
+
+  // reserve the frame, unless its page has been pinned meanwhile; pinning fails from now on
+  if (!state.compare_exchange_strong(frameBits, FRAME_RESERVED, std::memory_order_acq_rel))
+    return false;
+
   // flush any existing changes to disk if necessary
-  if (bufDescTable[clockHand].dirty)
+  if (frameBits & FRAME_DIRTY)
   {
     bufStats.diskwrites++;
-    //status = bufDescTable[clockHand].file->writePage(bufDescTable[clockHand].pageNo,
-    bufDescTable[clockHand].file->writePage(bufDescTable[clockHand].pageNo, bufPool[clockHand]);
+    try
+    {
+      std::lock_guard<std::mutex> fileGuard(fileLatch);
+      tmpbuf->file->writePage(tmpbuf->pageNo, bufPool[frameNo]);
+    }
+    catch(...)
+    {
+      state.store(frameBits, std::memory_order_release);
+      throw;
+    }
   }
+  hashTable->remove(tmpbuf->file, tmpbuf->pageNo);
 
-	//Reset all the BufDesc entry for the frame before returning the frame
-  bufDescTable[clockHand].Clear();
+  //Reset all the BufDesc entry for the frame, which stays reserved
+  unlinkFrame(frameNo);
+  tmpbuf->Clear();
+  return true;
+}
+
+
+void BufMgr::allocRingBuf(BufferRing & ring, FrameId & frame, const std::size_t heldPartition)
+{
+  std::lock_guard<std::mutex> ringGuard(ring.latch);
+  FrameId &slot = ring.frames[ring.next];
+  ring.next = (ring.next + 1) % ring.frames.size();
+
+  if (slot != NO_FRAME)
+  {
+    std::unique_lock<std::mutex> frameGuard(bufDescTable[slot].latch, std::try_to_lock);
+    std::uint32_t frameBits = frameState[slot].load(std::memory_order_acquire);
+    // reuse the frame unless someone else is using its page
+    if (frameGuard.owns_lock() && !(frameBits & (FRAME_PINS | FRAME_REFERENCED)))
+    {
+      if (!(frameBits & FRAME_VALID))
+      {
+        if (frameState[slot].compare_exchange_strong(frameBits, FRAME_RESERVED, std::memory_order_acquire))
+        {
+          frame = slot;
+          return;
+        }
+      }
+      else if (evictFrame(slot, heldPartition))
+      {
+        policy->frameCleared(slot);
+        frame = slot;
+        return;
+      }
+    }
+  }
+
+  // take a frame from the pool and keep it in the ring from now on
+  allocBuf(frame, heldPartition);
+  slot = frame;
+}
 
-  // return new frame number
-  frame = clockHand;
-} // end allocBuf
+
+bool BufMgr::pinFrame(const FrameId frameNo, const File* file, const PageId pageNo, const AccessHint hint)
+{
+  // set the referenced bit, unless the page is just passed over by a scan
+  const std::uint32_t reference = (hint != SEQUENTIAL_ACCESS) ? FRAME_REFERENCED : 0;
+  std::atomic<std::uint32_t>& state = frameState[frameNo];
+  std::uint32_t frameBits = state.load(std::memory_order_relaxed);
+  do
+  {
+    if (!(frameBits & FRAME_VALID))
+      return false;
+  } while (!state.compare_exchange_weak(frameBits, (frameBits + 1) | reference,
+                                        std::memory_order_acquire, std::memory_order_relaxed));
+
+  // pinned, so the frame keeps its page; it may have been given to another
+  // page since the lookup though
+  BufDesc* tmpbuf = &(bufDescTable[frameNo]);
+  if (tmpbuf->file != file || tmpbuf->pageNo != pageNo)
+  {
+    state.fetch_sub(1, std::memory_order_release);
+    return false;
+  }
+
+  policy->frameAccessed(frameNo, hint);
+  return true;
+}
+
+
+void BufMgr::linkFrame(const FrameId frameNo)
+{
+  BufDesc* tmpbuf = &(bufDescTable[frameNo]);
+  std::lock_guard<std::mutex> listGuard(frameListLatch);
+
+  // push onto the front of the list of the file
+  std::unordered_map<std::uint32_t, FrameId>::iterator head = fileFrames.find(tmpbuf->file->id());
+  tmpbuf->filePrev = NO_FRAME;
+  if (head == fileFrames.end())
+  {
+    tmpbuf->fileNext = NO_FRAME;
+    fileFrames[tmpbuf->file->id()] = frameNo;
+  }
+  else
+  {
+    tmpbuf->fileNext = head->second;
+    bufDescTable[head->second].filePrev = frameNo;
+    head->second = frameNo;
+  }
+}
+
+
+void BufMgr::unlinkFrame(const FrameId frameNo)
+{
+  BufDesc* tmpbuf = &(bufDescTable[frameNo]);
+  syncDirtyList(frameNo);
+
+  std::lock_guard<std::mutex> listGuard(frameListLatch);
+  if (tmpbuf->fileNext != NO_FRAME)
+    bufDescTable[tmpbuf->fileNext].filePrev = tmpbuf->filePrev;
+  if (tmpbuf->filePrev != NO_FRAME)
+    bufDescTable[tmpbuf->filePrev].fileNext = tmpbuf->fileNext;
+  else if (tmpbuf->fileNext != NO_FRAME)
+    fileFrames[tmpbuf->file->id()] = tmpbuf->fileNext;
+  else
+    fileFrames.erase(tmpbuf->file->id());
+  tmpbuf->fileNext = tmpbuf->filePrev = NO_FRAME;
+}
+
+
+void BufMgr::syncDirtyList(const FrameId frameNo)
+{
+  BufDesc* tmpbuf = &(bufDescTable[frameNo]);
+  std::lock_guard<std::mutex> listGuard(frameListLatch);
+  const bool dirty = (frameState[frameNo].load(std::memory_order_relaxed) & FRAME_DIRTY) != 0;
+  if (tmpbuf->inDirtyList == dirty)
+    return;
+  tmpbuf->inDirtyList = dirty;
+
+  if (dirty)
+  {
+    // append, so the list stays ordered by the time frames became dirty
+    tmpbuf->dirtyNext = NO_FRAME;
+    tmpbuf->dirtyPrev = lastDirtyFrame;
+    if (lastDirtyFrame != NO_FRAME)
+      bufDescTable[lastDirtyFrame].dirtyNext = frameNo;
+    else
+      dirtyFrames = frameNo;
+    lastDirtyFrame = frameNo;
+    numDirty++;
+  }
+  else
+  {
+    if (tmpbuf->dirtyNext != NO_FRAME)
+      bufDescTable[tmpbuf->dirtyNext].dirtyPrev = tmpbuf->dirtyPrev;
+    else
+      lastDirtyFrame = tmpbuf->dirtyPrev;
+    if (tmpbuf->dirtyPrev != NO_FRAME)
+      bufDescTable[tmpbuf->dirtyPrev].dirtyNext = tmpbuf->dirtyNext;
+    else
+      dirtyFrames = tmpbuf->dirtyNext;
+    tmpbuf->dirtyNext = tmpbuf->dirtyPrev = NO_FRAME;
+    numDirty--;
+  }
+}
+
+
+bool BufMgr::pinForWrite(const FrameId frameNo)
+{
+  std::atomic<std::uint32_t>& state = frameState[frameNo];
+  std::uint32_t frameBits = state.load(std::memory_order_acquire);
+  if ((frameBits & (FRAME_VALID | FRAME_DIRTY)) != (FRAME_VALID | FRAME_DIRTY) || (frameBits & FRAME_PINS))
+    return false;
+  if (!state.compare_exchange_strong(frameBits, (frameBits + 1) & ~FRAME_DIRTY, std::memory_order_acq_rel))
+    return false;
+  syncDirtyList(frameNo);
+  return true;
+}
+
+
+void BufMgr::writeFrames(std::vector<FrameId> & frames)
+{
+  // the frames are pinned, so the pages they hold cannot change
+  const BufDesc* descs = bufDescTable;
+  std::sort(frames.begin(), frames.end(), [descs](const FrameId a, const FrameId b) {
+    if (descs[a].file->id() != descs[b].file->id())
+      return descs[a].file->id() < descs[b].file->id();
+    return descs[a].pageNo < descs[b].pageNo;
+  });
+
+  try
+  {
+    std::lock_guard<std::mutex> fileGuard(fileLatch);
+    std::vector<const Page*> run;
+    for (std::size_t j = 0; j < frames.size(); j += run.size())
+    {
+      // collect the pages following the first one in its file
+      const BufDesc* first = &(bufDescTable[frames[j]]);
+      run.clear();
+      run.push_back(&bufPool[frames[j]]);
+      while (j + run.size() < frames.size()
+             && bufDescTable[frames[j + run.size()]].file == first->file
+             && bufDescTable[frames[j + run.size()]].pageNo == first->pageNo + run.size())
+        run.push_back(&bufPool[frames[j + run.size()]]);
+
+      first->file->writePages(first->pageNo, &run[0], run.size());
+      bufStats.diskwrites += run.size();
+    }
+  }
+  catch (...)
+  {
+    for (std::size_t j = 0; j < frames.size(); j++)
+    {
+      frameState[frames[j]].fetch_or(FRAME_DIRTY, std::memory_order_relaxed);
+      syncDirtyList(frames[j]);
+      frameState[frames[j]].fetch_sub(1, std::memory_order_release);
+    }
+    throw;
+  }
+
+  for (std::size_t j = 0; j < frames.size(); j++)
+    frameState[frames[j]].fetch_sub(1, std::memory_order_release);
+}
+
+
+void BufMgr::releaseFrame(const FrameId frameNo)
+{
+  std::lock_guard<std::mutex> frameGuard(bufDescTable[frameNo].latch);
+  bufDescTable[frameNo].Clear();
+  frameState[frameNo].store(0, std::memory_order_release);
+}
 
 	
-void BufMgr::readPage(File* file, const PageId pageNo, Page*& page)
+void BufMgr::readPage(File* file, const PageId pageNo, Page*& page, const AccessHint hint)
+{
+  fetchPage(file, pageNo, page, hint, NULL);
+}
+
+
+void BufMgr::readPage(File* file, const PageId pageNo, Page*& page, BufferRing& ring)
+{
+  fetchPage(file, pageNo, page, SEQUENTIAL_ACCESS, &ring);
+}
+
+
+PageHandle BufMgr::pinPage(File* file, const PageId pageNo, const AccessHint hint)
+{
+  Page* page;
+  fetchPage(file, pageNo, page, hint, NULL);
+  return PageHandle(this, file, pageNo, page);
+}
+
+
+PageHandle BufMgr::pinPage(File* file, const PageId pageNo, BufferRing& ring)
+{
+  Page* page;
+  fetchPage(file, pageNo, page, SEQUENTIAL_ACCESS, &ring);
+  return PageHandle(this, file, pageNo, page);
+}
+
+
+PageHandle BufMgr::pinNewPage(File* file, PageId &pageNo)
+{
+  Page* page;
+  allocPage(file, pageNo, page);
+  return PageHandle(this, file, pageNo, page);
+}
+
+
+void BufMgr::fetchPage(File* file, const PageId pageNo, Page*& page, const AccessHint hint, BufferRing* ring)
 {
   // check to see if it is already in the buffer pool
-  // std::cout << "readPage called on file.page " << file << "." << pageNo << endl;
   FrameId frameNo = 0;
-	try
-	{
-  	hashTable->lookup(file, pageNo, frameNo);
-
-    // set the referenced bit
-    bufDescTable[frameNo].refbit = true;
-    bufDescTable[frameNo].pinCnt++;
+  if (hashTable->find(file, pageNo, frameNo) && pinFrame(frameNo, file, pageNo, hint))
+  {
     page = &bufPool[frameNo];
+    return;
   }
-  catch(const HashNotFoundException &e) //not in the buffer pool, must allocate a new page
+
+  // not in the buffer pool, or evicted meanwhile.  While holding the latch of
+  // its partition nobody else can load or evict the page.
+  const std::size_t partition = hashTable->partition(file, pageNo);
+  std::lock_guard<std::mutex> partitionGuard(hashTable->partitionLatch(partition));
+  if (hashTable->find(file, pageNo, frameNo) && pinFrame(frameNo, file, pageNo, hint))
   {
-    // alloc a new frame
-    allocBuf(frameNo);
+    page = &bufPool[frameNo];
+    return;
+  }
+
+  //not in the buffer pool, alloc a new frame
+  if (ring != NULL)
+    allocRingBuf(*ring, frameNo, partition);
+  else
+    allocBuf(frameNo, partition);
 
-    // read the page into the new frame
-    bufStats.diskreads++;
-    //status = file->readPage(pageNo, &bufPool[frameNo]);
-    bufPool[frameNo] = file->readPage(pageNo);
+  // read the page into the new frame
+  bufStats.diskreads++;
+  try
+  {
+    file->readPageInto(pageNo, bufPool[frameNo]);
+  }
+  catch(...)
+  {
+    releaseFrame(frameNo);
+    throw;
+  }
 
-    // set up the entry properly
+  // set up the entry properly
+  {
+    std::lock_guard<std::mutex> frameGuard(bufDescTable[frameNo].latch);
     bufDescTable[frameNo].Set(file, pageNo);
-    page = &bufPool[frameNo];
+    linkFrame(frameNo);
+    policy->frameLoaded(frameNo, hint);
+    frameFreeSpace[frameNo].store(file->freeSpaceEntryOf(bufPool[frameNo]), std::memory_order_relaxed);
+    frameState[frameNo].store(FRAME_VALID | 1 | (hint == SEQUENTIAL_ACCESS ? 0 : FRAME_REFERENCED),
+                              std::memory_order_release);
+  }
+  page = &bufPool[frameNo];
+
+  // insert in the hash table
+  hashTable->insert(file, pageNo, frameNo);
+}
+
+
+void BufMgr::prefetchPage(File* file, const PageId pageNo, const AccessHint hint, BufferRing* ring)
+{
+  // cheap check before queueing anything
+  FrameId frameNo;
+  if (hashTable->find(file, pageNo, frameNo))
+    return;
+
+  {
+    std::lock_guard<std::mutex> prefetchGuard(prefetchLatch);
+    // more pending pages than a quarter of the pool would evict each other
+    if (prefetchStop || prefetchQueue.size() >= numBufs / 4 + 1)
+      return;
+    PrefetchRequest request = {file, pageNo, hint, ring};
+    prefetchQueue.push_back(request);
+    if (!prefetcher.joinable())
+      prefetcher = std::thread(&BufMgr::prefetchLoop, this);
+  }
+  prefetchCond.notify_all();
+}
+
+void BufMgr::cancelPrefetch(const File* file)
+{
+  std::unique_lock<std::mutex> prefetchGuard(prefetchLatch);
+  for (std::deque<PrefetchRequest>::iterator it = prefetchQueue.begin(); it != prefetchQueue.end(); )
+  {
+    if (it->file == file)
+      it = prefetchQueue.erase(it);
+    else
+      ++it;
+  }
+  while (prefetchInFlight == file)
+    prefetchCond.wait(prefetchGuard);
+}
+
+void BufMgr::prefetchLoop()
+{
+  std::unique_lock<std::mutex> prefetchGuard(prefetchLatch);
+  while (true)
+  {
+    while (!prefetchStop && prefetchQueue.empty())
+      prefetchCond.wait(prefetchGuard);
+    if (prefetchStop)
+      return;
+
+    const PrefetchRequest request = prefetchQueue.front();
+    prefetchQueue.pop_front();
+    prefetchInFlight = request.file;
+    prefetchGuard.unlock();
+
+    // read the page in and leave it unpinned; failures only lose the hint
+    try
+    {
+      Page* page;
+      fetchPage(request.file, request.pageNo, page, request.hint, request.ring);
+      unPinPage(request.file, request.pageNo, false);
+    }
+    catch (const BadgerDbException &e)
+    {
+    }
+
+    prefetchGuard.lock();
+    prefetchInFlight = NULL;
+    prefetchCond.notify_all();
+  }
+}
 
-    // insert in the hash table
-    hashTable->insert(file, pageNo, frameNo);
+void BufMgr::startBackgroundWriter(const BackgroundWriterConfig& config)
+{
+  stopBackgroundWriter();
+  writerConfig = config;
+  writerStop = false;
+  writer = std::thread(&BufMgr::writerLoop, this);
+}
+
+void BufMgr::stopBackgroundWriter()
+{
+  {
+    std::lock_guard<std::mutex> writerGuard(writerLatch);
+    writerStop = true;
   }
+  writerCond.notify_all();
+  if (writer.joinable())
+    writer.join();
 }
 
+void BufMgr::writerLoop()
+{
+  const std::uint32_t high = (std::uint32_t)(writerConfig.highWatermark * numBufs);
+  const std::uint32_t low = (std::uint32_t)(writerConfig.lowWatermark * numBufs);
+  bool writing = false;
+
+  std::unique_lock<std::mutex> writerGuard(writerLatch);
+  while (!writerStop)
+  {
+    writerCond.wait_for(writerGuard, std::chrono::milliseconds(writerConfig.intervalMs));
+    if (writerStop)
+      break;
+    writerGuard.unlock();
+
+    std::uint32_t dirty;
+    {
+      std::lock_guard<std::mutex> listGuard(frameListLatch);
+      dirty = numDirty;
+    }
+    // start above the high watermark and keep going down to the low one
+    if (dirty > high)
+      writing = true;
+    if (writing && dirty <= low)
+      writing = false;
+    if (writing)
+      writeDirtyFrames(writerConfig.maxPagesPerRound, low);
+
+    writerGuard.lock();
+  }
+}
+
+void BufMgr::writeDirtyFrames(const std::uint32_t maxPages, const std::uint32_t target)
+{
+  std::lock_guard<std::mutex> roundGuard(writerRoundLatch);
+
+  // take the oldest dirty frames; they are likely to reach the clock hand first
+  std::vector<FrameId> candidates;
+  {
+    std::lock_guard<std::mutex> listGuard(frameListLatch);
+    const std::uint32_t excess = numDirty > target ? numDirty - target : 0;
+    for (FrameId i = dirtyFrames; i != NO_FRAME && candidates.size() < std::min(maxPages, excess); i = bufDescTable[i].dirtyNext)
+      candidates.push_back(i);
+  }
+
+  std::vector<FrameId> frames;
+  for (std::size_t j = 0; j < candidates.size(); j++)
+  {
+    std::unique_lock<std::mutex> frameGuard(bufDescTable[candidates[j]].latch, std::try_to_lock);
+
+    // a pinned page may be in the middle of being changed, so it is skipped
+    if (frameGuard.owns_lock() && pinForWrite(candidates[j]))
+      frames.push_back(candidates[j]);
+  }
+
+  try
+  {
+    writeFrames(frames);
+  }
+  catch (const BadgerDbException &e)
+  {
+    // the pages stay dirty, they are written when evicted or flushed
+  }
+}
 
 void BufMgr::unPinPage(File* file, const PageId pageNo, const bool dirty) 
 {
-  // lookup in hashtable
+  // lookup in hashtable, a page that is not buffered cannot be pinned
   FrameId frameNo = 0;
-  hashTable->lookup(file, pageNo, frameNo);
+  if (!hashTable->find(file, pageNo, frameNo))
+  {
+  	throw PageNotPinnedException(file->filename(), pageNo, frameNo);
+  }
 
-  if (dirty == true) bufDescTable[frameNo].dirty = dirty;
+  BufDesc* tmpbuf = &(bufDescTable[frameNo]);
+  std::atomic<std::uint32_t>& state = frameState[frameNo];
+  const std::uint32_t dirtyBit = (dirty == true) ? FRAME_DIRTY : 0;
+  std::uint32_t frameBits = state.load(std::memory_order_relaxed);
 
-  // make sure the page is actually pinned
-  if (bufDescTable[frameNo].pinCnt == 0)
+  // keep the file's free-space map up to date while the caller still holds its pin;
+  // the map is only touched, under its latch, when the entry of the page changes
+  if (dirtyBit && (frameBits & FRAME_VALID) && (frameBits & FRAME_PINS) != 0 && tmpbuf->file == file && tmpbuf->pageNo == pageNo)
   {
-  	throw PageNotPinnedException(file->filename(), pageNo, frameNo);
+    const std::uint8_t entry = file->freeSpaceEntryOf(bufPool[frameNo]);
+    if (frameFreeSpace[frameNo].exchange(entry, std::memory_order_relaxed) != entry)
+      file->recordFreeSpace(pageNo, entry);
   }
-  else bufDescTable[frameNo].pinCnt--;
+
+  do
+  {
+    // make sure the page is actually pinned; a pinned frame keeps its page
+    if (!(frameBits & FRAME_VALID) || (frameBits & FRAME_PINS) == 0 || tmpbuf->file != file || tmpbuf->pageNo != pageNo)
+    {
+    	throw PageNotPinnedException(file->filename(), pageNo, frameNo);
+    }
+  } while (!state.compare_exchange_weak(frameBits, (frameBits - 1) | dirtyBit,
+                                        std::memory_order_acq_rel, std::memory_order_relaxed));
+
+  if (dirtyBit && !(frameBits & FRAME_DIRTY))
+    syncDirtyList(frameNo);
 }
 
 void BufMgr::allocPage(File* file, PageId &pageNo, Page*& page) 
 {
   FrameId frameNo;
 
-  // alloc a new frame
-  allocBuf(frameNo);
+  // alloc a new frame.  The page number is not known yet, so no partition is held.
+  allocBuf(frameNo, NO_PARTITION);
 
   // allocate a new page in the file
-	//std::cerr << "buffer data size:" << bufPool[frameNo].data_.length() << "\n";
-  bufPool[frameNo] = file->allocatePage(pageNo);
+  try
+  {
+    std::lock_guard<std::mutex> fileGuard(fileLatch);
+    file->allocatePageInto(pageNo, bufPool[frameNo]);
+  }
+  catch(...)
+  {
+    releaseFrame(frameNo);
+    throw;
+  }
   page = &bufPool[frameNo];
 
   // set up the entry properly
-  bufDescTable[frameNo].Set(file, pageNo);
+  std::lock_guard<std::mutex> partitionGuard(hashTable->partitionLatch(hashTable->partition(file, pageNo)));
+  {
+    std::lock_guard<std::mutex> frameGuard(bufDescTable[frameNo].latch);
+    bufDescTable[frameNo].Set(file, pageNo);
+    linkFrame(frameNo);
+    policy->frameLoaded(frameNo, NORMAL_ACCESS);
+    frameFreeSpace[frameNo].store(file->freeSpaceEntryOf(bufPool[frameNo]), std::memory_order_relaxed);
+    frameState[frameNo].store(FRAME_VALID | 1 | FRAME_REFERENCED, std::memory_order_release);
+  }
 
   // insert in the hash table
   hashTable->insert(file, pageNo, frameNo);
@@ -189,45 +800,174 @@ void BufMgr::allocPage(File* file, PageId &pageNo, Page*& page)
 
 void BufMgr::flushFile(const File* file) 
 {
-  for (std::uint32_t i = 0; i < numBufs; i++)
+  // a page being prefetched is pinned for a moment
+  cancelPrefetch(file);
+
+  // pages taken by the writer are pinned and no longer dirty until written
+  std::lock_guard<std::mutex> roundGuard(writerRoundLatch);
+
+  // only the frames of the file are looked at
+  std::vector<FrameId> frames;
+  {
+    std::lock_guard<std::mutex> listGuard(frameListLatch);
+    std::unordered_map<std::uint32_t, FrameId>::const_iterator head = fileFrames.find(file->id());
+    if (head != fileFrames.end())
+      for (FrameId i = head->second; i != NO_FRAME; i = bufDescTable[i].fileNext)
+        frames.push_back(i);
+  }
+
+  // write the dirty pages first, in page order, so that adjacent pages are
+  // written together; pinned pages are left for the check below
+  std::vector<FrameId> toWrite;
+  for (std::size_t j = 0; j < frames.size(); j++)
+  {
+    BufDesc* tmpbuf = &(bufDescTable[frames[j]]);
+    std::lock_guard<std::mutex> frameGuard(tmpbuf->latch);
+    if (tmpbuf->file == file && pinForWrite(frames[j]))
+      toWrite.push_back(frames[j]);
+  }
+  writeFrames(toWrite);
+
+  for (std::size_t j = 0; j < frames.size(); j++)
 	{
+    const FrameId i = frames[j];
   	BufDesc* tmpbuf = &(bufDescTable[i]);
-  	if(tmpbuf->file && tmpbuf->valid == true && tmpbuf->file == file)
-		{
-	    if (tmpbuf->pinCnt > 0)
-  			throw PagePinnedException(file->filename(), tmpbuf->pageNo, tmpbuf->frameNo);
-
-	    if (tmpbuf->dirty == true)
-			{
-				//if ((status = tmpbuf->file->writePage(tmpbuf->pageNo, &(bufPool[i]))) != OK)
-				tmpbuf->file->writePage(tmpbuf->pageNo, bufPool[i]);
-				tmpbuf->dirty = false;
-    	}
-
-    	hashTable->remove(file,tmpbuf->pageNo);
-    	tmpbuf->Clear();
-  	}
-		else if (tmpbuf->valid == false && tmpbuf->file == file)
-  		throw BadBufferException(tmpbuf->frameNo, tmpbuf->dirty, tmpbuf->valid, tmpbuf->refbit);
+    PageId pageNo;
+    {
+      std::lock_guard<std::mutex> frameGuard(tmpbuf->latch);
+      const std::uint32_t frameBits = frameState[i].load(std::memory_order_acquire);
+      if (!(frameBits & FRAME_VALID) && tmpbuf->file != NULL && tmpbuf->file == file)
+        throw BadBufferException(tmpbuf->frameNo, (frameBits & FRAME_DIRTY) != 0, false,
+                                 (frameBits & FRAME_REFERENCED) != 0);
+      if (!tmpbuf->file || !(frameBits & FRAME_VALID) || tmpbuf->file != file)
+        continue;
+      pageNo = tmpbuf->pageNo;
+    }
+
+    // latch the partition of the page first, then check the frame still holds it
+    std::lock_guard<std::mutex> partitionGuard(hashTable->partitionLatch(hashTable->partition(file, pageNo)));
+    std::lock_guard<std::mutex> frameGuard(tmpbuf->latch);
+    std::uint32_t frameBits = frameState[i].load(std::memory_order_acquire);
+    if (!(frameBits & FRAME_VALID) || tmpbuf->file != file || tmpbuf->pageNo != pageNo)
+      continue;
+
+    // reserve the frame, unless its page is pinned
+    do
+    {
+      if (frameBits & FRAME_PINS)
+        throw PagePinnedException(file->filename(), tmpbuf->pageNo, tmpbuf->frameNo);
+    } while (!frameState[i].compare_exchange_weak(frameBits, FRAME_RESERVED, std::memory_order_acq_rel));
+
+    if (frameBits & FRAME_DIRTY)
+    {
+      try
+      {
+        std::lock_guard<std::mutex> fileGuard(fileLatch);
+        tmpbuf->file->writePage(tmpbuf->pageNo, bufPool[i]);
+      }
+      catch(...)
+      {
+        frameState[i].store(frameBits, std::memory_order_release);
+        throw;
+      }
+    }
+
+    hashTable->remove(file,tmpbuf->pageNo);
+    policy->frameCleared(i);
+    unlinkFrame(i);
+    tmpbuf->Clear();
+    frameState[i].store(0, std::memory_order_release);
   }
+
+  // make the pages written out durable
+  file->sync();
 }
 
 void BufMgr::disposePage(File* file, const PageId pageNo)
 {
-	//Deallocate from file altogether
-  //See if it is in the buffer pool
-  FrameId frameNo = 0;
-  hashTable->lookup(file, pageNo, frameNo);
+  {
+    std::lock_guard<std::mutex> partitionGuard(hashTable->partitionLatch(hashTable->partition(file, pageNo)));
 
-	// clear the page
-	bufDescTable[frameNo].Clear();
+    //See if it is in the buffer pool
+    FrameId frameNo = 0;
+    if (hashTable->find(file, pageNo, frameNo))
+    {
+      // clear the page
+      {
+        // pins of the page go away with it
+        std::lock_guard<std::mutex> frameGuard(bufDescTable[frameNo].latch);
+        frameState[frameNo].exchange(FRAME_RESERVED, std::memory_order_acq_rel);
+        policy->frameCleared(frameNo);
+        unlinkFrame(frameNo);
+        bufDescTable[frameNo].Clear();
+        frameState[frameNo].store(0, std::memory_order_release);
+      }
 
-	hashTable->remove(file, pageNo);
+      hashTable->remove(file, pageNo);
+    }
+  }
 
-  // deallocate it in the file	
+	//Deallocate from file altogether
+  std::lock_guard<std::mutex> fileGuard(fileLatch);
   file->deletePage(pageNo);
 }
 
+//----------------------------------------
+// PageHandle
+//----------------------------------------
+
+PageHandle::PageHandle()
+	: bufMgr(NULL), file(NULL), pageNum(Page::INVALID_NUMBER), page(NULL), dirty(false)
+{
+}
+
+PageHandle::PageHandle(BufMgr* bufMgr, File* file, const PageId pageNo, Page* page)
+	: bufMgr(bufMgr), file(file), pageNum(pageNo), page(page), dirty(false)
+{
+}
+
+PageHandle::PageHandle(PageHandle&& other)
+	: bufMgr(other.bufMgr), file(other.file), pageNum(other.pageNum), page(other.page), dirty(other.dirty)
+{
+  other.page = NULL;
+}
+
+PageHandle& PageHandle::operator=(PageHandle&& other)
+{
+  if (this != &other)
+  {
+    release();
+    bufMgr = other.bufMgr;
+    file = other.file;
+    pageNum = other.pageNum;
+    page = other.page;
+    dirty = other.dirty;
+    other.page = NULL;
+  }
+  return *this;
+}
+
+PageHandle::~PageHandle()
+{
+  try
+  {
+    release();
+  }
+  catch (const BadgerDbException &e)
+  {
+    // the page has been disposed of while held, there is no pin left to drop
+  }
+}
+
+void PageHandle::release()
+{
+  if (page == NULL)
+    return;
+  page = NULL;
+  bufMgr->unPinPage(file, pageNum, dirty);
+  dirty = false;
+}
+
 void BufMgr::printSelf(void) 
 {
   BufDesc* tmpbuf;
@@ -237,9 +977,10 @@ void BufMgr::printSelf(void)
 	{
   	tmpbuf = &(bufDescTable[i]);
 		std::cout << "FrameNo:" << i << " ";
-		tmpbuf->Print();
+		const std::uint32_t frameBits = frameState[i].load();
+		tmpbuf->Print(frameBits);
 
-  	if (tmpbuf->valid == true)
+  	if (frameBits & FRAME_VALID)
     	validFrames++;
   }
 
@@ -9,7 +9,16 @@
 
 #include "file.h"
 #include "bufHashTbl.h"
+#include "replacement.h"
 #include <iostream>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 namespace badgerdb {
 
@@ -18,8 +27,46 @@ namespace badgerdb {
 */
 class BufMgr;
 
+/**
+ * @brief Frame number standing for no frame, such as the end of a frame list.
+ */
+const FrameId NO_FRAME = (FrameId)-1;
+
+/**
+ * @brief Mask of the pin count in the state word of a frame.
+ */
+const std::uint32_t FRAME_PINS = 0x00ffffff;
+
+/**
+ * @brief State word bit set when the frame has been referenced recently.
+ */
+const std::uint32_t FRAME_REFERENCED = 1u << 24;
+
+/**
+ * @brief State word bit set when the page in the frame is dirty.
+ */
+const std::uint32_t FRAME_DIRTY = 1u << 25;
+
+/**
+ * @brief State word bit set when the frame holds a page.
+ */
+const std::uint32_t FRAME_VALID = 1u << 26;
+
+/**
+ * @brief State word of a frame reserved by a thread: not valid, pinned once.
+ */
+const std::uint32_t FRAME_RESERVED = 1;
+
 /**
 * @brief Class for maintaining information about buffer pool frames
+*
+* The pin count, referenced, dirty and valid bits of a frame are kept apart,
+* packed into one atomic state word per frame (see BufMgr), so that pages can
+* be pinned and unpinned without a latch and the clock sweep reads a compact
+* array.  The members here change only while the frame is not valid and its
+* latch is held; a thread that has the frame pinned can read them without the
+* latch.  A frame whose state is FRAME_RESERVED is reserved by a thread that is
+* loading a page into it or clearing it.
 */
 class BufDesc {
 
@@ -42,36 +89,32 @@ class BufDesc {
   FrameId	frameNo;
 
 	/**
-   * Number of times this page has been pinned
+   * Latch serializing the loading, eviction and clearing of this frame
 	 */
-  int pinCnt;
+  std::mutex latch;
 
 	/**
-   * True if page is dirty;  false otherwise
+   * Next and previous frame holding a page of the same file, or NO_FRAME
 	 */
-  bool dirty;
+  FrameId fileNext, filePrev;
 
 	/**
-   * True if page is valid
+   * Next and previous dirty frame, or NO_FRAME
 	 */
-  bool valid;
+  FrameId dirtyNext, dirtyPrev;
 
 	/**
-   * Has this buffer frame been reference recently
+   * True while the frame is in the list of dirty frames
 	 */
-  bool refbit;
+  bool inDirtyList;
 
 	/**
    * Initialize buffer frame for a new user
 	 */
   void Clear()
 	{
-    pinCnt = 0;
 		file = NULL;
 		pageNo = Page::INVALID_NUMBER;
-    dirty = false;
-    refbit = false;
-		valid = false;
   };
 
 	/**
@@ -85,13 +128,14 @@ class BufDesc {
 	{ 
 		file = filePtr;
     pageNo = pageNum;
-    pinCnt = 1;
-    dirty = false;
-    valid = true;
-    refbit = true;
   }
 
-  void Print()
+	/**
+	 * Print the members of the frame along with its state word.
+	 *
+	 * @param state 	State word of the frame
+	 */
+  void Print(const std::uint32_t state)
 	{
 		if(file != NULL)
 		{
@@ -101,10 +145,10 @@ class BufDesc {
 		else
 			std::cout << "file:NULL ";
 
-		std::cout << "valid:" << valid << " ";
-		std::cout << "pinCnt:" << pinCnt << " ";
-		std::cout << "dirty:" << dirty << " ";
-		std::cout << "refbit:" << refbit << "\n";
+		std::cout << "valid:" << ((state & FRAME_VALID) != 0) << " ";
+		std::cout << "pinCnt:" << (state & FRAME_PINS) << " ";
+		std::cout << "dirty:" << ((state & FRAME_DIRTY) != 0) << " ";
+		std::cout << "refbit:" << ((state & FRAME_REFERENCED) != 0) << "\n";
   }
 
 	/**
@@ -113,6 +157,8 @@ class BufDesc {
   BufDesc()
 	{
   	Clear();
+		fileNext = filePrev = dirtyNext = dirtyPrev = NO_FRAME;
+		inDirtyList = false;
   }
 };
 
@@ -125,17 +171,17 @@ struct BufStats
 	/**
    * Total number of accesses to buffer pool
 	 */
-  int accesses;
+  std::atomic<int> accesses;
 
 	/**
    * Number of pages read from disk (including allocs)
 	 */
-  int diskreads;
+  std::atomic<int> diskreads;
 
 	/**
    * Number of pages written back to disk
 	 */
-  int diskwrites;
+  std::atomic<int> diskwrites;
 
 	/**
    * Clear all values 
@@ -156,16 +202,342 @@ struct BufStats
 
 
 /**
-* @brief The central class which manages the buffer pool including frame allocation and deallocation to pages in the file 
+ * @brief Default number of frames in a BufferRing.
+ */
+const std::uint32_t BUFFERRING_SIZE = 32;
+
+/**
+* @brief A small private set of frames that a bulk scan recycles for the pages it reads.
+*
+* Pages read through a ring are loaded into the frames of the ring in turn,
+* evicting the page the ring loaded there before, so that a scan of any size
+* displaces at most the ring's worth of pages from the buffer pool.  A frame
+* that is pinned, or has been referenced by someone else since the ring loaded
+* it, is left alone and replaced in the ring by a frame from the pool.
 */
-class BufMgr 
+class BufferRing
 {
+	friend class BufMgr;
+
+ public:
+	/**
+   * Constructor of BufferRing class
+	 *
+	 * @param size  	Number of frames in the ring
+	 */
+  explicit BufferRing(const std::uint32_t size = BUFFERRING_SIZE)
+		: frames(size, NO_FRAME), next(0)
+	{
+	}
+
+	/**
+   * Get number of frames in the ring
+	 */
+  std::uint32_t getSize() const
+	{
+		return frames.size();
+	}
+
  private:
 	/**
-   * Current position of clockhand in our buffer pool
+   * Frame of every slot of the ring
+	 */
+  std::vector<FrameId> frames;
+
+	/**
+   * Slot to be used next
+	 */
+  std::uint32_t next;
+
+	/**
+   * Protects the ring, which the prefetch thread uses as well as the scan
+	 */
+  std::mutex latch;
+};
+
+
+/**
+* @brief A page queued to be read into the buffer pool in the background.
+*/
+struct PrefetchRequest
+{
+	/**
+   * File of the page
+	 */
+  File* file;
+
+	/**
+   * Page number in the file
+	 */
+  PageId pageNo;
+
+	/**
+   * How the page is expected to be used
+	 */
+  AccessHint hint;
+
+	/**
+   * Ring to read the page into, or NULL
+	 */
+  BufferRing* ring;
+};
+
+
+/**
+* @brief Settings of the background writer of a BufMgr.
+*
+* The writer wakes up every interval.  Once more than highWatermark of the
+* frames are dirty it writes back unpinned dirty pages, oldest first and at
+* most maxPagesPerRound per wakeup, until no more than lowWatermark of the
+* frames are dirty.
+*/
+struct BackgroundWriterConfig
+{
+	/**
+   * Time between two rounds of the writer, in milliseconds
+	 */
+  std::uint32_t intervalMs;
+
+	/**
+   * Maximum number of pages written in one round
+	 */
+  std::uint32_t maxPagesPerRound;
+
+	/**
+   * Fraction of dirty frames above which the writer starts writing
+	 */
+  double highWatermark;
+
+	/**
+   * Fraction of dirty frames at which the writer stops writing
+	 */
+  double lowWatermark;
+
+	/**
+   * Constructor of BackgroundWriterConfig class, with the default settings
+	 */
+  BackgroundWriterConfig()
+		: intervalMs(10), maxPagesPerRound(32), highWatermark(0.25), lowWatermark(0.1)
+  {
+  }
+};
+
+
+/**
+ * @brief Kind of memory pages backing the buffer pool.
+ */
+enum PoolPages
+{
+	/**
+	 * Pages of the default size
+	 */
+	SMALL_PAGES,
+
+	/**
+	 * Ask the kernel to back the pool with transparent huge pages where it can
+	 */
+	TRANSPARENT_HUGE_PAGES,
+
+	/**
+	 * Take 2 MB pages from the reserved huge page pool, falling back to
+	 * transparent huge pages if none are reserved
+	 */
+	EXPLICIT_HUGE_PAGES
+};
+
+/**
+ * @brief Placement of the buffer pool memory on the nodes of a NUMA machine.
+ */
+enum PoolPlacement
+{
+	/**
+	 * Leave the placement to the kernel, which puts a page on the node of the
+	 * thread first touching it
+	 */
+	DEFAULT_PLACEMENT,
+
+	/**
+	 * Spread the pool over all nodes, page by page
+	 */
+	INTERLEAVED_PLACEMENT,
+
+	/**
+	 * Put the pool on one node, preferably
+	 */
+	NODE_PLACEMENT
+};
+
+/**
+* @brief Settings of the memory holding the buffer pool of a BufMgr.
+*
+* The pool is mapped with mmap() so that every frame is aligned to the memory
+* page size.  Huge pages cut down TLB misses for large pools.  The settings are
+* hints: what the kernel does not support is left out.  Whether the placement
+* could be set is reported by BufMgr::getPoolPlacement().
+*/
+struct BufMgrConfig
+{
+	/**
+   * Kind of memory pages to use
+	 */
+  PoolPages pages;
+
+	/**
+   * Placement of the pool on NUMA nodes
+	 */
+  PoolPlacement placement;
+
+	/**
+   * Node to put the pool on, for NODE_PLACEMENT
+	 */
+  int node;
+
+	/**
+   * Constructor of BufMgrConfig class, with the default settings
+	 */
+  BufMgrConfig()
+		: pages(TRANSPARENT_HUGE_PAGES), placement(DEFAULT_PLACEMENT), node(0)
+  {
+  }
+};
+
+
+/**
+ * @brief Passed to BufMgr::allocBuf() by callers that hold no hash table partition latch.
+ */
+const std::size_t NO_PARTITION = (std::size_t)-1;
+
+/**
+* @brief A pin on a page in the buffer pool, dropped when the handle goes away.
+*
+* Returned by BufMgr::pinPage() and BufMgr::pinNewPage().  Handles can be
+* moved but not copied, so every pin has exactly one owner.  The page is
+* unpinned, as dirty if markDirty() has been called, when the handle is
+* released, destroyed or assigned another page.
+*/
+class PageHandle
+{
+ public:
+	/**
+   * Constructs a handle holding no page
+	 */
+  PageHandle();
+
+	/**
+   * Takes over the pin held by another handle, which is left holding no page
+	 */
+  PageHandle(PageHandle&& other);
+
+	/**
+   * Unpins the page held, if any, and takes over the pin held by another handle
+	 */
+  PageHandle& operator=(PageHandle&& other);
+
+	/**
+   * Unpins the page held, if any
+	 */
+  ~PageHandle();
+
+	/**
+   * Returns the page held, or NULL
+	 */
+  Page* get() const
+  {
+		return page;
+  }
+
+  Page* operator->() const
+  {
+		return page;
+  }
+
+  Page& operator*() const
+  {
+		return *page;
+  }
+
+	/**
+   * Returns the number of the page held
+	 */
+  PageId pageNo() const
+  {
+		return pageNum;
+  }
+
+	/**
+   * True if the handle holds a page
+	 */
+  explicit operator bool() const
+  {
+		return page != NULL;
+  }
+
+	/**
+   * Marks the page dirty, so that it is written back once unpinned
+	 */
+  void markDirty()
+  {
+		dirty = true;
+  }
+
+	/**
+	 * Unpins the page held now rather than when the handle is destroyed.
+	 * Does nothing if no page is held.
+	 *
+   * @throws  PageNotPinnedException If the page has been disposed of meanwhile
+	 */
+  void release();
+
+ private:
+  friend class BufMgr;
+
+	/**
+   * Constructs a handle for a page pinned by the buffer manager
+	 */
+  PageHandle(BufMgr* bufMgr, File* file, const PageId pageNo, Page* page);
+
+  PageHandle(const PageHandle&) = delete;
+  PageHandle& operator=(const PageHandle&) = delete;
+
+	/**
+   * Buffer manager the page is pinned in
+	 */
+  BufMgr* bufMgr;
+
+	/**
+   * File of the page
+	 */
+  File* file;
+
+	/**
+   * Number of the page in the file
 	 */
-  FrameId clockHand;
+  PageId pageNum;
 
+	/**
+   * Page in the buffer pool, or NULL if no page is held
+	 */
+  Page* page;
+
+	/**
+   * True if the page is to be unpinned as dirty
+	 */
+  bool dirty;
+};
+
+
+/**
+* @brief The central class which manages the buffer pool including frame allocation and deallocation to pages in the file 
+*
+* All public methods may be called concurrently.  Frames are protected by
+* per-frame latches and the hash table by per-partition latches, always
+* acquired in the order partition latch, frame latch, file latch.  Page hits
+* in readPage() and unPinPage() take no latch at all: they only update the
+* atomic state word of the frame.
+*/
+class BufMgr 
+{
+ private:
 	/**
    * Number of frames in the buffer pool
 	 */
@@ -181,26 +553,260 @@ class BufMgr
 	 */
   BufDesc *bufDescTable;
 
+	/**
+   * State word of every frame: the pin count and the FRAME_REFERENCED, FRAME_DIRTY
+   * and FRAME_VALID bits.  Pins are taken and dropped with atomic updates; a frame
+   * is taken away from its page by changing its state from valid and unpinned to
+   * FRAME_RESERVED, which makes further pins fail.
+	 */
+  std::atomic<std::uint32_t> *frameState;
+
+	/**
+   * Free-space map entry last recorded for the page of every frame, so that
+   * unPinPage() only goes to the file's map when the entry has changed
+	 */
+  std::atomic<std::uint8_t> *frameFreeSpace;
+
 	/**
    * Maintains Buffer pool usage statistics 
 	 */
   BufStats bufStats;
 
 	/**
-   * Advance clock to next frame in the buffer pool
+   * Serializes calls that modify File objects; only reading pages from a File is threadsafe
 	 */
-  void advanceClock()
-  {
-		clockHand = (clockHand + 1) % numBufs;
-  }
+  std::mutex fileLatch;
+
+	/**
+   * Replacement policy choosing the frames to evict
+	 */
+  ReplacementPolicy *policy;
+
+	/**
+	 * Allocate a free frame.  The frame is returned reserved (invalid with a pin count of 1)
+	 * so that no other thread can allocate it; the caller either sets it up or clears it.
+	 *
+	 * @param frame   	Frame reference, frame ID of allocated frame returned via this variable
+	 * @param heldPartition  Hash table partition whose latch the caller holds, or NO_PARTITION
+	 * @throws BufferExceededException If no such buffer is found which can be allocated
+	 */
+  void allocBuf(FrameId & frame, const std::size_t heldPartition);
 
 	/**
-	 * Allocate a free frame.  
+	 * Allocate the next frame of a ring, falling back to allocBuf() if the page in
+	 * it is in use.  Returns the frame reserved like allocBuf() does.
 	 *
+	 * @param ring  	Ring to take the frame from
 	 * @param frame   	Frame reference, frame ID of allocated frame returned via this variable
+	 * @param heldPartition  Hash table partition whose latch the caller holds, or NO_PARTITION
 	 * @throws BufferExceededException If no such buffer is found which can be allocated
 	 */
-  void allocBuf(FrameId & frame);
+  void allocRingBuf(BufferRing & ring, FrameId & frame, const std::size_t heldPartition);
+
+	/**
+	 * Evicts the page held by an unpinned valid frame and reserves the frame.
+	 * The frame latch must be held.
+	 *
+	 * @param frameNo 	Frame number
+	 * @param heldPartition  Hash table partition whose latch the caller holds, or NO_PARTITION
+	 * @return  			False if the frame is pinned or the latch of the page's partition is
+	 *              	busy and nothing was done
+	 */
+  bool evictFrame(const FrameId frameNo, const std::size_t heldPartition);
+
+	/**
+   * Protects the per-file frame lists and the dirty list
+	 */
+  std::mutex frameListLatch;
+
+	/**
+   * First frame of the frame list of every file with pages in the pool, by file id
+	 */
+  std::unordered_map<std::uint32_t, FrameId> fileFrames;
+
+	/**
+   * First frame of the list of dirty frames, the one dirtied longest ago, or NO_FRAME
+	 */
+  FrameId dirtyFrames;
+
+	/**
+   * Last frame of the list of dirty frames, or NO_FRAME
+	 */
+  FrameId lastDirtyFrame;
+
+	/**
+   * Number of frames in the list of dirty frames
+	 */
+  std::uint32_t numDirty;
+
+	/**
+	 * Adds a frame that has just been set up to the frame list of its file.
+	 * The frame latch must be held.
+	 *
+	 * @param frameNo 	Frame number
+	 */
+  void linkFrame(const FrameId frameNo);
+
+	/**
+	 * Removes a reserved frame about to be cleared from the frame list of its
+	 * file and from the dirty list.  The frame latch must be held.
+	 *
+	 * @param frameNo 	Frame number
+	 */
+  void unlinkFrame(const FrameId frameNo);
+
+	/**
+	 * Adds a frame to the dirty list or removes it, as its dirty bit says.
+	 * Called after the dirty bit has been changed; when two threads change it
+	 * at once, the one calling last leaves the list right.
+	 *
+	 * @param frameNo 	Frame number
+	 */
+  void syncDirtyList(const FrameId frameNo);
+
+	/**
+	 * Pins an unpinned dirty frame and marks it clean, so that it can be
+	 * written back by writeFrames().  Changes made to the page meanwhile
+	 * mark it dirty again.  The frame latch must be held.
+	 *
+	 * @param frameNo 	Frame number
+	 * @return  			True if the frame was valid, dirty and unpinned and has been pinned
+	 */
+  bool pinForWrite(const FrameId frameNo);
+
+	/**
+	 * Writes back the pages of frames pinned by pinForWrite() and unpins them.
+	 * The pages are sorted by file and page number so that pages adjacent
+	 * in a file go out with one write.  If writing fails, the frames are
+	 * unpinned and marked dirty again.
+	 *
+	 * @param frames 	Frames to write back; sorted by this call
+	 */
+  void writeFrames(std::vector<FrameId> & frames);
+
+	/**
+	 * Reads a page like the public readPage(), through a ring if one is given.
+	 */
+  void fetchPage(File* file, const PageId pageNo, Page*& page, const AccessHint hint, BufferRing* ring);
+
+	/**
+	 * Pin a frame if it still holds the given page.  Takes no latch.
+	 *
+	 * @param frameNo 	Frame number
+	 * @param file   	File object
+	 * @param pageNo  Page number in the file
+	 * @param hint  	How the page is expected to be used
+	 * @return  			True if the frame held the page and has been pinned
+	 */
+  bool pinFrame(const FrameId frameNo, const File* file, const PageId pageNo, const AccessHint hint);
+
+	/**
+	 * Give back a frame reserved by allocBuf() which could not be set up.
+	 *
+	 * @param frameNo 	Frame number
+	 */
+  void releaseFrame(const FrameId frameNo);
+
+	/**
+   * Pages waiting to be read in by the prefetch thread
+	 */
+  std::deque<PrefetchRequest> prefetchQueue;
+
+	/**
+   * Protects prefetchQueue, prefetchInFlight and prefetchStop
+	 */
+  std::mutex prefetchLatch;
+
+	/**
+   * Signalled when requests are queued and when a request has been served
+	 */
+  std::condition_variable prefetchCond;
+
+	/**
+   * File of the request the prefetch thread is serving, or NULL
+	 */
+  const File* prefetchInFlight;
+
+	/**
+   * Set to make the prefetch thread exit
+	 */
+  bool prefetchStop;
+
+	/**
+   * Thread reading in queued pages, started by the first prefetchPage() call
+	 */
+  std::thread prefetcher;
+
+	/**
+   * Body of the prefetch thread.
+	 */
+  void prefetchLoop();
+
+	/**
+   * Settings of the background writer
+	 */
+  BackgroundWriterConfig writerConfig;
+
+	/**
+   * Protects writerStop
+	 */
+  std::mutex writerLatch;
+
+	/**
+   * Signalled to make the background writer exit
+	 */
+  std::condition_variable writerCond;
+
+	/**
+   * Set to make the background writer exit
+	 */
+  bool writerStop;
+
+	/**
+   * Background writer thread, started by startBackgroundWriter()
+	 */
+  std::thread writer;
+
+	/**
+   * Held by the background writer for a whole round, while the frames it
+   * writes are pinned, and by flushFile(), so that a flush neither skips
+   * pages the writer has taken nor finds them pinned
+	 */
+  std::mutex writerRoundLatch;
+
+	/**
+   * Body of the background writer thread.
+	 */
+  void writerLoop();
+
+	/**
+	 * Writes back up to the given number of unpinned dirty pages, oldest first,
+	 * until no more than target frames are dirty.  Frames busy with another
+	 * thread are skipped.
+	 *
+	 * @param maxPages 	Maximum number of pages to write
+	 * @param target 	Number of dirty frames to stop at
+	 */
+  void writeDirtyFrames(const std::uint32_t maxPages, const std::uint32_t target);
+
+	/**
+   * Size of the memory mapping holding bufPool, in bytes
+	 */
+  std::size_t poolSize;
+
+	/**
+   * Placement in effect for bufPool, DEFAULT_PLACEMENT if the one asked for could not be set
+	 */
+  PoolPlacement poolPlacement;
+
+	/**
+	 * Maps the memory for bufPool as given by the configuration and constructs
+	 * the frames in it.
+	 *
+	 * @param config  	Settings of the memory
+	 * @throws std::bad_alloc If the memory cannot be mapped
+	 */
+  void allocPool(const BufMgrConfig& config);
 
  public:
 	/**
@@ -210,8 +816,14 @@ class BufMgr
 
 	/**
    * Constructor of BufMgr class
+	 *
+	 * @param bufs  	Number of frames in the buffer pool
+	 * @param replacementPolicy  Policy for bufs frames choosing the pages to evict, deleted by the
+	 *              	buffer manager.  The clock algorithm is used if none is given.
+	 * @param config  	Settings of the memory holding the buffer pool
 	 */
-  BufMgr(std::uint32_t bufs);
+  BufMgr(std::uint32_t bufs, ReplacementPolicy *replacementPolicy = NULL,
+         const BufMgrConfig& config = BufMgrConfig());
 	
 	/**
    * Destructor of BufMgr class
@@ -226,8 +838,79 @@ class BufMgr
 	 * @param file   	File object
 	 * @param PageNo  Page number in the file to be read
 	 * @param page  	Reference to page pointer. Used to fetch the Page object in which requested page from file is read in.
+	 * @param hint  	How the page is expected to be used.  Scans pass SEQUENTIAL_ACCESS so that
+	 *              	their pages do not push frequently used pages out of the pool.
 	 */
-  void readPage(File* file, const PageId PageNo, Page*& page);
+  void readPage(File* file, const PageId PageNo, Page*& page, const AccessHint hint = NORMAL_ACCESS);
+
+	/**
+	 * Reads the given page like readPage() with SEQUENTIAL_ACCESS, but loads a page that
+	 * is not buffered into a frame of the given ring instead of one chosen by the
+	 * replacement policy.
+	 *
+	 * @param file   	File object
+	 * @param PageNo  Page number in the file to be read
+	 * @param page  	Reference to page pointer. Used to fetch the Page object in which requested page from file is read in.
+	 * @param ring  	Ring of the caller
+	 */
+  void readPage(File* file, const PageId PageNo, Page*& page, BufferRing& ring);
+
+	/**
+	 * Reads a page like readPage() and returns a handle that unpins it.
+	 *
+	 * @param file   	File object
+	 * @param PageNo  Page number in the file to be read
+	 * @param hint  	How the page is expected to be used
+	 * @return  			Handle holding the pinned page
+	 */
+  PageHandle pinPage(File* file, const PageId PageNo, const AccessHint hint = NORMAL_ACCESS);
+
+	/**
+	 * Reads a page through a ring like readPage() and returns a handle that unpins it.
+	 *
+	 * @param file   	File object
+	 * @param PageNo  Page number in the file to be read
+	 * @param ring  	Ring of the caller
+	 * @return  			Handle holding the pinned page
+	 */
+  PageHandle pinPage(File* file, const PageId PageNo, BufferRing& ring);
+
+	/**
+	 * Asks for a page to be read into the buffer pool in the background, so that
+	 * a later readPage() of it is a hit.  The page is not pinned.  Requests are a
+	 * hint: they are dropped if too many are pending, and errors reading the page
+	 * are ignored.
+	 *
+	 * @param file   	File object, must stay open until the request is served or cancelled
+	 * @param PageNo  Page number in the file to be read
+	 * @param hint  	How the page is expected to be used
+	 * @param ring  	Ring to read the page into, or NULL; must outlive the request like the file
+	 */
+  void prefetchPage(File* file, const PageId PageNo, const AccessHint hint = NORMAL_ACCESS, BufferRing* ring = NULL);
+
+	/**
+	 * Starts a thread writing back dirty pages in the background, so that
+	 * allocating a frame seldom has to write out the page evicted from it.
+	 * A writer already running is restarted with the new settings.  Files must
+	 * be flushed with flushFile() before they are closed while the writer runs.
+	 *
+	 * @param config  	Rate and watermarks of the writer
+	 */
+  void startBackgroundWriter(const BackgroundWriterConfig& config = BackgroundWriterConfig());
+
+	/**
+	 * Stops the background writer, if running.  Dirty pages it has not written
+	 * stay in the buffer pool.
+	 */
+  void stopBackgroundWriter();
+
+	/**
+	 * Drops the pending prefetch requests for a file and waits for one in progress
+	 * to finish.  Must be called before a file that has been prefetched from is closed.
+	 *
+	 * @param file   	File object
+	 */
+  void cancelPrefetch(const File* file);
 
 	/**
 	 * Unpin a page from memory since it is no longer required for it to remain in memory.
@@ -250,7 +933,18 @@ class BufMgr
   void allocPage(File* file, PageId &PageNo, Page*& page); 
 
 	/**
-	 * Writes out all dirty pages of the file to disk.
+	 * Allocates a new page like allocPage() and returns a handle that unpins it.
+	 *
+	 * @param file   	File object
+	 * @param PageNo  Page number. The number assigned to the page in the file is returned via this reference.
+	 * @return  			Handle holding the pinned page
+	 */
+  PageHandle pinNewPage(File* file, PageId &PageNo);
+
+	/**
+	 * Writes out all dirty pages of the file to disk and syncs the file.  Pending
+	 * prefetch requests for the file are cancelled, and a round of the
+	 * background writer in progress is waited for.
 	 * All the frames assigned to the file need to be unpinned from buffer pool before this function can be successfully called.
 	 * Otherwise Error returned.
 	 *
@@ -274,6 +968,24 @@ class BufMgr
 	 */
   void  printSelf();
 
+	/**
+   * Get number of frames in the buffer pool
+	 */
+  std::uint32_t getNumBufs() const
+  {
+		return numBufs;
+  }
+
+	/**
+   * Get the NUMA placement in effect for the buffer pool.  It is
+   * DEFAULT_PLACEMENT when the placement asked for in the BufMgrConfig could
+   * not be set, for instance on a kernel without NUMA support.
+	 */
+  PoolPlacement getPoolPlacement() const
+  {
+		return poolPlacement;
+  }
+
 	/**
    * Get buffer pool usage statistics
 	 */
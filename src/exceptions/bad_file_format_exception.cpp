@@ -0,0 +1,24 @@
+/**
+ * @author See Contributors.txt for code contributors and overview of BadgerDB.
+ *
+ * @section LICENSE
+ * Copyright (c) 2012 Database Group, Computer Sciences Department, University of Wisconsin-Madison.
+ */
+
+#include "bad_file_format_exception.h"
+
+#include <sstream>
+#include <string>
+
+namespace badgerdb {
+
+BadFileFormatException::BadFileFormatException(
+    const std::string& name, const std::uint32_t format_version)
+    : BadgerDbException(""), filename_(name), format_version_(format_version) {
+  std::stringstream ss;
+  ss << "File " << filename_ << " is not in the current file format, found "
+     << "format version " << format_version_;
+  message_.assign(ss.str());
+}
+
+}
@@ -0,0 +1,54 @@
+/**
+ * @author See Contributors.txt for code contributors and overview of BadgerDB.
+ *
+ * @section LICENSE
+ * Copyright (c) 2012 Database Group, Computer Sciences Department, University of Wisconsin-Madison.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "badgerdb_exception.h"
+
+namespace badgerdb {
+
+/**
+ * @brief An exception that is thrown when a file is opened whose header does
+ *        not describe a file in the format written by this code.
+ */
+class BadFileFormatException : public BadgerDbException {
+ public:
+  /**
+   * Constructs a bad file format exception for the given file.
+   *
+   * @param name            Name of file with the unexpected format.
+   * @param format_version  Format version found in the file header.
+   */
+  BadFileFormatException(const std::string& name,
+                         const std::uint32_t format_version);
+
+  /**
+   * Returns the name of the file that caused this exception.
+   */
+  virtual const std::string& filename() const { return filename_; }
+
+  /**
+   * Returns the format version found in the file header.
+   */
+  virtual std::uint32_t format_version() const { return format_version_; }
+
+ protected:
+  /**
+   * Name of file that caused this exception.
+   */
+  const std::string& filename_;
+
+  /**
+   * Format version found in the file header.
+   */
+  const std::uint32_t format_version_;
+};
+
+}
@@ -7,24 +7,38 @@
 
 #include "file.h"
 
-#include <fstream>
+#include <algorithm>
 #include <iostream>
 #include <memory>
 #include <string>
 #include <cstdio>
+#include <cstring>
 #include <cassert>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
+#include "exceptions/bad_file_format_exception.h"
 #include "exceptions/file_exists_exception.h"
 #include "exceptions/file_not_found_exception.h"
 #include "exceptions/file_open_exception.h"
+#include "exceptions/file_io_exception.h"
 #include "exceptions/invalid_page_exception.h"
 #include "file_iterator.h"
 #include "page.h"
 
 namespace badgerdb {
 
-File::StreamMap File::open_streams_;
+/**
+ * Maximum number of pages that writePages() hands to one gathering write.
+ */
+static const std::size_t MAX_PAGES_PER_WRITE = 64;
+
+File::OpenFileMap File::open_files_;
 File::CountMap File::open_counts_;
+std::atomic<std::uint32_t> File::next_id_(1);
 
 void File::remove(const std::string& filename) {
   if (!exists(filename)) {
@@ -44,14 +58,8 @@ bool File::isOpen(const std::string& filename) {
 }
 
 bool File::exists(const std::string& filename) {
-	std::fstream file(filename);
-	if(file)
-	{
-		file.close();
-		return true;
-	}
-
-	return false;
+	struct stat status;
+	return ::stat(filename.c_str(), &status) == 0;
 }
 
 File::~File() {
@@ -64,13 +72,16 @@ PageId File::getFirstPageNo() {
   return header.first_used_page;
 }
 
-File::File(const std::string& name, const bool create_new) : filename_(name) {
+File::File(const std::string& name, const bool create_new)
+    : filename_(name), id_(next_id_++) {
   openIfNeeded(create_new);
 
   if (create_new) {
     // File starts with 1 page (the header).
-    FileHeader header = {1 /* num_pages */, 0 /* first_used_page */,
-                         0 /* num_free_pages */, 0 /* first_free_page */};
+    FileHeader header = {FILE_MAGIC, FILE_FORMAT_VERSION,
+                         1 /* num_pages */, 0 /* first_used_page */,
+                         0 /* num_free_pages */, 0 /* first_free_page */,
+                         0 /* last_used_page */};
     writeHeader(header);
   }
 }
@@ -78,26 +89,40 @@ File::File(const std::string& name, const bool create_new) : filename_(name) {
 void File::openIfNeeded(const bool create_new) {
   if (open_counts_.find(filename_) != open_counts_.end()) {	//exists an entry already
     ++open_counts_[filename_];
-    stream_ = open_streams_[filename_];
+    open_file_ = open_files_[filename_];
   } else {
-    std::ios_base::openmode mode =
-        std::fstream::in | std::fstream::out | std::fstream::binary;
+    int flags = O_RDWR;
     const bool already_exists = exists(filename_);
     if (create_new) {
       // Error if we try to overwrite an existing file.
       if (already_exists) {
         throw FileExistsException(filename_);
       }
-      // New files have to be truncated on open.
-      mode = mode | std::fstream::trunc;
+      // New files have to be created and truncated on open.
+      flags |= O_CREAT | O_TRUNC;
     } else {
       // Error if we try to open a file that doesn't exist.
       if (!already_exists) {
         throw FileNotFoundException(filename_);
       }
     }
-    stream_.reset(new std::fstream(filename_, mode));
-    open_streams_[filename_] = stream_;
+    const int fd = ::open(filename_.c_str(), flags, 0644);
+    if (fd < 0) {
+      throw FileIOException(filename_, errno);
+    }
+    open_file_.reset(new OpenFile(fd));
+    if (!create_new) {
+      readAt(0 /* pos */, &open_file_->header_, sizeof(FileHeader));
+      const FileHeader header = open_file_->header_;
+      if (header.magic != FILE_MAGIC ||
+          header.format_version != FILE_FORMAT_VERSION) {
+        // Not written by this code, or in an older layout.
+        open_file_.reset();
+        throw BadFileFormatException(
+            filename_, header.magic == FILE_MAGIC ? header.format_version : 0);
+      }
+    }
+    open_files_[filename_] = open_file_;
     open_counts_[filename_] = 1;
   }
 }
@@ -106,26 +131,141 @@ void File::close() {
 	if(open_counts_[filename_] > 0)
   	--open_counts_[filename_];
 
-  stream_.reset();
+  open_file_.reset();
 	assert(open_counts_[filename_] >= 0);
 
   if (open_counts_[filename_] == 0) {
-    open_streams_.erase(filename_);
+    open_files_.erase(filename_);
     open_counts_.erase(filename_);
   }
 }
 
+void File::sync() const {
+  {
+    std::lock_guard<std::mutex> free_space_guard(open_file_->free_space_latch_);
+    if (!open_file_->writeFreeSpaceMap()) {
+      throw FileIOException(filename_, errno);
+    }
+  }
+  {
+    std::lock_guard<std::mutex> header_guard(open_file_->header_latch_);
+    if (open_file_->header_dirty_) {
+      writeAt(0 /* pos */, &open_file_->header_, sizeof(FileHeader));
+      open_file_->header_dirty_ = false;
+    }
+  }
+  if (::fsync(open_file_->fd()) != 0) {
+    throw FileIOException(filename_, errno);
+  }
+}
+
+void File::readAt(const off_t position, void* buffer, const std::size_t length) const {
+  char* bytes = static_cast<char*>(buffer);
+  std::size_t done = 0;
+  while (done < length) {
+    const ssize_t result = ::pread(open_file_->fd(), bytes + done, length - done, position + done);
+    if (result < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw FileIOException(filename_, errno);
+    }
+    if (result == 0) {
+      // end of file
+      std::memset(bytes + done, 0, length - done);
+      return;
+    }
+    done += result;
+  }
+}
+
+void File::writeAt(const off_t position, const void* buffer, const std::size_t length) const {
+  const char* bytes = static_cast<const char*>(buffer);
+  std::size_t done = 0;
+  while (done < length) {
+    const ssize_t result = ::pwrite(open_file_->fd(), bytes + done, length - done, position + done);
+    if (result < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw FileIOException(filename_, errno);
+    }
+    done += result;
+  }
+}
+
+void File::writeVectored(off_t position, struct iovec* parts, int count) const {
+  while (count > 0) {
+    const ssize_t result = ::pwritev(open_file_->fd(), parts, count, position);
+    if (result < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw FileIOException(filename_, errno);
+    }
+    position += result;
+
+    // skip the buffers written completely, then the written part of the next one
+    std::size_t written = result;
+    while (count > 0 && written >= parts->iov_len) {
+      written -= parts->iov_len;
+      ++parts;
+      --count;
+    }
+    if (count > 0) {
+      parts->iov_base = static_cast<char*>(parts->iov_base) + written;
+      parts->iov_len -= written;
+    }
+  }
+}
+
 FileHeader File::readHeader() const {
-  FileHeader header;
-  stream_->seekg(0 /* pos */, std::ios::beg);
-  stream_->read(reinterpret_cast<char*>(&header), sizeof(FileHeader));
-  return header;
+  std::lock_guard<std::mutex> header_guard(open_file_->header_latch_);
+  return open_file_->header_;
 }
 
 void File::writeHeader(const FileHeader& header) {
-  stream_->seekp(0 /* pos */, std::ios::beg);
-  stream_->write(reinterpret_cast<const char*>(&header), sizeof(FileHeader));
-  stream_->flush();
+  std::lock_guard<std::mutex> header_guard(open_file_->header_latch_);
+  open_file_->header_ = header;
+  open_file_->header_dirty_ = true;
+}
+
+bool OpenFile::writeFreeSpaceMap() {
+  for (std::size_t map = 0; map < free_space_dirty_.size(); ++map) {
+    // entries of map page k start right after it, at page k * (FSM_ENTRIES_PER_PAGE + 1) + 2
+    const std::size_t first = map * (FSM_ENTRIES_PER_PAGE + 1) + 2;
+    if (!free_space_dirty_[map] || first >= free_space_.size()) {
+      continue;
+    }
+    const std::size_t count = std::min<std::size_t>(FSM_ENTRIES_PER_PAGE,
+                                                    free_space_.size() - first);
+    const off_t position = sizeof(FileHeader) + (off_t)(first - 2) * Page::SIZE
+                           + sizeof(PageHeader);
+    std::size_t done = 0;
+    while (done < count) {
+      const ssize_t result = ::pwrite(fd_, &free_space_[first] + done, count - done,
+                                      position + done);
+      if (result < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return false;
+      }
+      done += result;
+    }
+    free_space_dirty_[map] = false;
+  }
+  return true;
+}
+
+OpenFile::~OpenFile() {
+  // nobody can be told about a failure here, so the write back is best effort
+  writeFreeSpaceMap();
+  if (header_dirty_) {
+    const ssize_t written = ::pwrite(fd_, &header_, sizeof(FileHeader), 0 /* pos */);
+    (void)written;
+  }
+  ::close(fd_);
 }
 
 
@@ -163,145 +303,307 @@ PageFile& PageFile::operator=(const PageFile& rhs) {
 }
 
 Page PageFile::allocatePage(PageId &new_page_number) {
-  FileHeader header = readHeader();
   Page new_page;
-  Page existing_page;
+  allocatePageInto(new_page_number, new_page);
+  return new_page;
+}
+
+void PageFile::allocatePageInto(PageId &new_page_number, Page &new_page) {
+  FileHeader header = readHeader();
   if (header.num_free_pages > 0) {
-    new_page = readPage(header.first_free_page, true /* allow_free */);
-    new_page.set_page_number(header.first_free_page);
-		new_page_number = new_page.page_number();
-    header.first_free_page = new_page.next_page_number();
+    // Reuse the page at the head of the free list.
+    new_page_number = header.first_free_page;
+    header.first_free_page = readPageHeader(new_page_number).next_page_number;
     --header.num_free_pages;
 
-    if (header.first_used_page == Page::INVALID_NUMBER ||
-        header.first_used_page > new_page.page_number()) {
-      // Either have no pages used or the head of the used list is a page later
-      // than the one we just allocated, so add the new page to the head.
-      if (header.first_used_page > new_page.page_number()) {
-        new_page.set_next_page_number(header.first_used_page);
-      }
-      header.first_used_page = new_page.page_number();
-    } else {
-      // New page is reused from somewhere after the beginning, so we need to
-      // find where in the used list to insert it.
-      PageId next_page_number = Page::INVALID_NUMBER;
-      for (FileIterator iter = begin(); iter != end(); ++iter) {
-        next_page_number = (*iter).next_page_number();
-        if (next_page_number > new_page.page_number() ||
-            next_page_number == Page::INVALID_NUMBER) {
-          existing_page = *iter;
-          break;
-        }
-      }
-      existing_page.set_next_page_number(new_page.page_number());
-      new_page.set_next_page_number(next_page_number);
-    }
-
     assert((header.num_free_pages == 0) ==
            (header.first_free_page == Page::INVALID_NUMBER));
   }
 	else
 	{
-    new_page.set_page_number(header.num_pages);
-		new_page_number = new_page.page_number();
-
-    if (header.first_used_page == Page::INVALID_NUMBER)
-		{
-      header.first_used_page = new_page.page_number();
-    }
-		else
-		{
-      // If we have pages allocated, we need to add the new page to the tail
-      // of the linked list.
-      for (FileIterator iter = begin(); iter != end(); ++iter) {
-        if ((*iter).next_page_number() == Page::INVALID_NUMBER) {
-          existing_page = *iter;
-          break;
-        }
-      }
-      assert(existing_page.isUsed());
-      existing_page.set_next_page_number(new_page.page_number());
+    // map pages are never handed out, their entries are written by sync()
+    new_page_number = header.num_pages;
+    if (isMapPage(new_page_number)) {
+      ++new_page_number;
     }
-    ++header.num_pages;
+    header.num_pages = new_page_number + 1;
   }
-  writePage(new_page_number, new_page.header_, new_page);
-  if (existing_page.page_number() != Page::INVALID_NUMBER) {
-    // If we updated an existing page by inserting the new page into the
-    // used list, we need to write it out.
-    writePage(existing_page.page_number(), existing_page.header_, existing_page);
+
+  // Append the new page to the tail of the used list, so neither allocation
+  // path has to walk the list.
+  new_page.initialize();
+  new_page.set_page_number(new_page_number);
+  new_page.set_prev_page_number(header.last_used_page);
+  if (header.last_used_page == Page::INVALID_NUMBER)
+	{
+    header.first_used_page = new_page_number;
   }
-  writeHeader(header);
+	else
+	{
+    PageHeader tail_header = readPageHeader(header.last_used_page);
+    tail_header.next_page_number = new_page_number;
+    writePageHeader(header.last_used_page, tail_header);
+  }
+  header.last_used_page = new_page_number;
 
-  return new_page;
+  writePage(new_page_number, new_page.header_, new_page);
+  writeHeader(header);
+  updateFreeSpace(new_page_number, new_page);
 }
 
 Page PageFile::readPage(const PageId page_number) const {
+  Page page;
+  readPageInto(page_number, page);
+  return page;
+}
+
+void PageFile::readPageInto(const PageId page_number, Page &page) const {
   FileHeader header = readHeader();
 
 	if (page_number >= header.num_pages)
 	{
 		throw InvalidPageException(page_number, filename_);
 	}
-	return readPage(page_number, false /* allow_free */);
+	readPageInto(page_number, page, false /* allow_free */);
 }
 
-Page PageFile::readPage(const PageId page_number, const bool allow_free) const {
-  Page page;
-  stream_->seekg(pagePosition(page_number), std::ios::beg);
-  stream_->read(reinterpret_cast<char*>(&page.header_), sizeof(PageHeader));
-  stream_->read(&page.data_[0], Page::DATA_SIZE);
+void PageFile::readPageInto(const PageId page_number, Page &page, const bool allow_free) const {
+  // header and data are contiguous, so the whole page is read with one call
+  readAt(pagePosition(page_number), &page.header_, Page::SIZE);
   if (!allow_free && !page.isUsed()) {
     throw InvalidPageException(page_number, filename_);
   }
-
-  return page;
 }
 
 void PageFile::writePage(const PageId new_page_number, const Page& new_page) {
-	PageHeader header = readPageHeader(new_page_number);
-	if (header.current_page_number == Page::INVALID_NUMBER)
-	{
-		// Page has been deleted since it was read.
-		throw InvalidPageException(new_page_number, filename_);
-	}
-	// Page on disk may have had its next page pointer updated since it was read;
-	// we don't modify that, but we do keep all the other modifications to the
-	// page header.
-	const PageId next_page_number = header.next_page_number;
-	header = new_page.header_;
-	header.next_page_number = next_page_number;
-	writePage(new_page_number, header, new_page);
+	writePage(new_page_number, headerForWrite(new_page_number, new_page), new_page);
+	updateFreeSpace(new_page_number, new_page);
+}
+
+void PageFile::writePages(const PageId first_page_number, const Page* const* pages,
+                          const std::size_t count) {
+  // every page is a header and the data, written in chunks of gathering writes
+  PageHeader headers[MAX_PAGES_PER_WRITE];
+  struct iovec parts[2 * MAX_PAGES_PER_WRITE];
+  for (std::size_t start = 0; start < count; start += MAX_PAGES_PER_WRITE) {
+    const std::size_t chunk = std::min(count - start, MAX_PAGES_PER_WRITE);
+    for (std::size_t i = 0; i < chunk; ++i) {
+      const Page& new_page = *pages[start + i];
+      headers[i] = headerForWrite(first_page_number + start + i, new_page);
+      parts[2 * i].iov_base = &headers[i];
+      parts[2 * i].iov_len = sizeof(PageHeader);
+      parts[2 * i + 1].iov_base = const_cast<char*>(&new_page.data_[0]);
+      parts[2 * i + 1].iov_len = Page::DATA_SIZE;
+    }
+    writeVectored(pagePosition(first_page_number + start), parts, 2 * chunk);
+  }
+
+  std::lock_guard<std::mutex> free_space_guard(open_file_->free_space_latch_);
+  loadFreeSpaceMap();
+  for (std::size_t i = 0; i < count; ++i) {
+    setFreeSpaceEntry(first_page_number + i, freeSpaceEntry(*pages[i]));
+  }
+}
+
+void PageFile::appendPages(Page* new_pages, const std::size_t count) {
+  if (count == 0) {
+    return;
+  }
+  FileHeader header = readHeader();
+
+  // Number and chain the pages the way allocatePage() would one by one.
+  PageId prev_page_number = header.last_used_page;
+  for (std::size_t i = 0; i < count; ++i) {
+    PageId new_page_number = header.num_pages;
+    if (isMapPage(new_page_number)) {
+      ++new_page_number;
+    }
+    header.num_pages = new_page_number + 1;
+    new_pages[i].set_page_number(new_page_number);
+    new_pages[i].set_prev_page_number(prev_page_number);
+    new_pages[i].set_next_page_number(Page::INVALID_NUMBER);
+    if (i > 0) {
+      new_pages[i - 1].set_next_page_number(new_page_number);
+    }
+    prev_page_number = new_page_number;
+  }
+
+  // Write runs of consecutive pages (a map page breaks a run) with gathering
+  // writes before anything links to them.
+  struct iovec parts[2 * MAX_PAGES_PER_WRITE];
+  std::size_t start = 0;
+  while (start < count) {
+    std::size_t run = 1;
+    while (start + run < count && run < MAX_PAGES_PER_WRITE &&
+           new_pages[start + run].page_number() ==
+               new_pages[start].page_number() + run) {
+      ++run;
+    }
+    for (std::size_t i = 0; i < run; ++i) {
+      Page& new_page = new_pages[start + i];
+      parts[2 * i].iov_base = &new_page.header_;
+      parts[2 * i].iov_len = sizeof(PageHeader);
+      parts[2 * i + 1].iov_base = &new_page.data_[0];
+      parts[2 * i + 1].iov_len = Page::DATA_SIZE;
+    }
+    writeVectored(pagePosition(new_pages[start].page_number()), parts, 2 * run);
+    start += run;
+  }
+
+  const PageId first_page_number = new_pages[0].page_number();
+  if (header.last_used_page == Page::INVALID_NUMBER) {
+    header.first_used_page = first_page_number;
+  } else {
+    PageHeader tail_header = readPageHeader(header.last_used_page);
+    tail_header.next_page_number = first_page_number;
+    writePageHeader(header.last_used_page, tail_header);
+  }
+  header.last_used_page = prev_page_number;
+  writeHeader(header);
+
+  std::lock_guard<std::mutex> free_space_guard(open_file_->free_space_latch_);
+  loadFreeSpaceMap();
+  for (std::size_t i = 0; i < count; ++i) {
+    setFreeSpaceEntry(new_pages[i].page_number(), freeSpaceEntry(new_pages[i]));
+  }
 }
 
 void PageFile::deletePage(const PageId page_number) {
   FileHeader header = readHeader();
 
-  Page existing_page = readPage(page_number);
-  Page previous_page;
-  // If this page is the head of the used list, update the header to point to
-  // the next page in line.
-  if (page_number == header.first_used_page) {
-    header.first_used_page = existing_page.next_page_number();
+  const PageHeader existing_header = readPageHeader(page_number);
+  if (page_number >= header.num_pages ||
+      existing_header.current_page_number == Page::INVALID_NUMBER) {
+    throw InvalidPageException(page_number, filename_);
+  }
+
+  // Unlink the page from the used list through its neighbours.
+  if (existing_header.prev_page_number == Page::INVALID_NUMBER) {
+    header.first_used_page = existing_header.next_page_number;
   } else {
-    // Walk the used list so we can update the page that points to this one.
-    for (FileIterator iter = begin(); iter != end(); ++iter) {
-      previous_page = *iter;
-      if (previous_page.next_page_number() == existing_page.page_number()) {
-        previous_page.set_next_page_number(existing_page.next_page_number());
-        break;
-      }
-    }
+    PageHeader prev_header = readPageHeader(existing_header.prev_page_number);
+    prev_header.next_page_number = existing_header.next_page_number;
+    writePageHeader(existing_header.prev_page_number, prev_header);
+  }
+  if (existing_header.next_page_number == Page::INVALID_NUMBER) {
+    header.last_used_page = existing_header.prev_page_number;
+  } else {
+    PageHeader next_header = readPageHeader(existing_header.next_page_number);
+    next_header.prev_page_number = existing_header.prev_page_number;
+    writePageHeader(existing_header.next_page_number, next_header);
   }
+
   // Clear the page and add it to the head of the free list.
-  existing_page.initialize();
-  existing_page.set_next_page_number(header.first_free_page);
+  Page cleared_page;
+  cleared_page.set_next_page_number(header.first_free_page);
   header.first_free_page = page_number;
   ++header.num_free_pages;
-  if (previous_page.isUsed()) {
-    writePage(previous_page.page_number(), previous_page.header_, previous_page);
-  }
-  writePage(page_number, existing_page.header_, existing_page);
+  writePage(page_number, cleared_page.header_, cleared_page);
   writeHeader(header);
+
+  std::lock_guard<std::mutex> free_space_guard(open_file_->free_space_latch_);
+  loadFreeSpaceMap();
+  setFreeSpaceEntry(page_number, 0);
+}
+
+void PageFile::updateFreeSpace(const PageId page_number, const Page& page) {
+  recordFreeSpace(page_number, freeSpaceEntry(page));
+}
+
+std::uint8_t PageFile::freeSpaceEntryOf(const Page& page) const {
+  return freeSpaceEntry(page);
+}
+
+void PageFile::recordFreeSpace(const PageId page_number, const std::uint8_t entry) {
+  std::lock_guard<std::mutex> free_space_guard(open_file_->free_space_latch_);
+  loadFreeSpaceMap();
+  setFreeSpaceEntry(page_number, entry);
+}
+
+PageId PageFile::findPageWithSpace(const std::size_t bytes) {
+  // entries round down, so a page whose entry covers the record has room for it
+  const std::size_t needed = std::max<std::size_t>(
+      1, (bytes + FSM_GRANULARITY - 1) / FSM_GRANULARITY);
+  std::lock_guard<std::mutex> free_space_guard(open_file_->free_space_latch_);
+  loadFreeSpaceMap();
+  const std::vector<std::uint8_t>& free_space = open_file_->free_space_;
+  std::vector<std::uint8_t>& block_max = open_file_->free_space_block_max_;
+  for (std::size_t block = 0; block < block_max.size(); ++block) {
+    if (block_max[block] < needed) {
+      continue;
+    }
+    const std::size_t first = block * FSM_BLOCK_PAGES;
+    const std::size_t last = std::min<std::size_t>(first + FSM_BLOCK_PAGES,
+                                                   free_space.size());
+    std::uint8_t largest = 0;
+    for (std::size_t page_number = first; page_number < last; ++page_number) {
+      if (free_space[page_number] >= needed) {
+        return page_number;
+      }
+      largest = std::max(largest, free_space[page_number]);
+    }
+    // nothing here is large enough, so the whole block has been seen
+    block_max[block] = largest;
+  }
+  return Page::INVALID_NUMBER;
+}
+
+std::uint8_t PageFile::freeSpaceEntry(const Page& page) {
+  // a record needs a new slot as well unless one is free
+  std::size_t free_space = page.getFreeSpace();
+  if (page.header_.num_free_slots == 0) {
+    free_space -= std::min(free_space, sizeof(PageSlot));
+  }
+  return free_space / FSM_GRANULARITY;
+}
+
+void PageFile::setFreeSpaceEntry(const PageId page_number, const std::uint8_t entry) {
+  std::vector<std::uint8_t>& free_space = open_file_->free_space_;
+  if (page_number >= free_space.size()) {
+    free_space.resize(page_number + 1, 0);
+  }
+  if (free_space[page_number] == entry) {
+    return;
+  }
+  free_space[page_number] = entry;
+
+  std::vector<std::uint8_t>& block_max = open_file_->free_space_block_max_;
+  const std::size_t block = page_number / FSM_BLOCK_PAGES;
+  if (block >= block_max.size()) {
+    block_max.resize(block + 1, 0);
+  }
+  block_max[block] = std::max(block_max[block], entry);
+
+  std::vector<bool>& dirty = open_file_->free_space_dirty_;
+  const std::size_t map = (page_number - 1) / (FSM_ENTRIES_PER_PAGE + 1);
+  if (map >= dirty.size()) {
+    dirty.resize(map + 1, false);
+  }
+  dirty[map] = true;
+}
+
+void PageFile::loadFreeSpaceMap() {
+  OpenFile& open_file = *open_file_;
+  if (open_file.free_space_loaded_) {
+    return;
+  }
+  const PageId num_pages = readHeader().num_pages;
+  open_file.free_space_.assign(num_pages, 0);
+  for (PageId map_page = 1; map_page < num_pages; map_page += FSM_ENTRIES_PER_PAGE + 1) {
+    const std::size_t count = std::min<std::size_t>(FSM_ENTRIES_PER_PAGE,
+                                                    num_pages - map_page - 1);
+    if (count > 0) {
+      readAt(pagePosition(map_page) + sizeof(PageHeader),
+             &open_file.free_space_[map_page + 1], count);
+    }
+  }
+  open_file.free_space_dirty_.assign((num_pages - 1) / (FSM_ENTRIES_PER_PAGE + 1) + 1, false);
+  open_file.free_space_block_max_.assign((num_pages - 1) / FSM_BLOCK_PAGES + 1, 0);
+  for (PageId page_number = 0; page_number < num_pages; ++page_number) {
+    std::uint8_t& largest = open_file.free_space_block_max_[page_number / FSM_BLOCK_PAGES];
+    largest = std::max(largest, open_file.free_space_[page_number]);
+  }
+  open_file.free_space_loaded_ = true;
 }
 
 FileIterator PageFile::begin() {
@@ -315,19 +617,43 @@ FileIterator PageFile::end() {
 
 void PageFile::writePage(const PageId page_number, const PageHeader& header,
                      const Page& new_page) {
-  stream_->seekp(pagePosition(page_number), std::ios::beg);
-  stream_->write(reinterpret_cast<const char*>(&header), sizeof(PageHeader));
-  stream_->write(&new_page.data_[0], Page::DATA_SIZE);
-  stream_->flush();
+  // header and data go out together with one gathering write
+  struct iovec parts[2];
+  parts[0].iov_base = const_cast<PageHeader*>(&header);
+  parts[0].iov_len = sizeof(PageHeader);
+  parts[1].iov_base = const_cast<char*>(&new_page.data_[0]);
+  parts[1].iov_len = Page::DATA_SIZE;
+  writeVectored(pagePosition(page_number), parts, 2);
 }
 
 PageHeader PageFile::readPageHeader(PageId page_number) const {
   PageHeader header;
-  stream_->seekg(pagePosition(page_number), std::ios::beg);
-  stream_->read(reinterpret_cast<char*>(&header), sizeof(PageHeader));
+  readAt(pagePosition(page_number), &header, sizeof(PageHeader));
   return header;
 }
 
+PageHeader PageFile::headerForWrite(const PageId page_number, const Page& new_page) const {
+	PageHeader header = readPageHeader(page_number);
+	if (header.current_page_number == Page::INVALID_NUMBER)
+	{
+		// Page has been deleted since it was read.
+		throw InvalidPageException(page_number, filename_);
+	}
+	// Page on disk may have had its next and previous page pointers updated
+	// since it was read; we don't modify those, but we do keep all the other
+	// modifications to the page header.
+	const PageId next_page_number = header.next_page_number;
+	const PageId prev_page_number = header.prev_page_number;
+	header = new_page.header_;
+	header.next_page_number = next_page_number;
+	header.prev_page_number = prev_page_number;
+	return header;
+}
+
+void PageFile::writePageHeader(const PageId page_number, const PageHeader& header) {
+  writeAt(pagePosition(page_number), &header, sizeof(PageHeader));
+}
+
 
 
 
@@ -361,8 +687,14 @@ BlobFile& BlobFile::operator=(const BlobFile& rhs) {
 }
 
 Page BlobFile::allocatePage(PageId &new_page_number) {
-  FileHeader header = readHeader();
 	Page new_page;
+	allocatePageInto(new_page_number, new_page);
+	return new_page;
+}
+
+void BlobFile::allocatePageInto(PageId &new_page_number, Page &new_page) {
+  FileHeader header = readHeader();
+	new_page.initialize();
 
 	new_page_number = header.num_pages;
 
@@ -374,21 +706,33 @@ Page BlobFile::allocatePage(PageId &new_page_number) {
 
 	writePage(new_page_number, new_page);
 	writeHeader(header);
-
-	return new_page;
 }
 
 Page BlobFile::readPage(const PageId page_number) const {
 	Page page;
-	stream_->seekg(pagePosition(page_number), std::ios::beg);
-	stream_->read(reinterpret_cast<char*>(&page), Page::SIZE);
+	readPageInto(page_number, page);
 	return page;
 }
 
+void BlobFile::readPageInto(const PageId page_number, Page &page) const {
+	readAt(pagePosition(page_number), &page, Page::SIZE);
+}
+
 void BlobFile::writePage(const PageId new_page_number, const Page& new_page) {
-	stream_->seekp(pagePosition(new_page_number), std::ios::beg);
-	stream_->write(reinterpret_cast<const char*>(&new_page), Page::SIZE);
-	stream_->flush();
+	writeAt(pagePosition(new_page_number), &new_page, Page::SIZE);
+}
+
+void BlobFile::writePages(const PageId first_page_number, const Page* const* pages,
+                          const std::size_t count) {
+  struct iovec parts[MAX_PAGES_PER_WRITE];
+  for (std::size_t start = 0; start < count; start += MAX_PAGES_PER_WRITE) {
+    const std::size_t chunk = std::min(count - start, MAX_PAGES_PER_WRITE);
+    for (std::size_t i = 0; i < chunk; ++i) {
+      parts[i].iov_base = const_cast<Page*>(pages[start + i]);
+      parts[i].iov_len = Page::SIZE;
+    }
+    writeVectored(pagePosition(first_page_number + start), parts, chunk);
+  }
 }
 
 //delePage should not be called for a blob_file, not supported
@@ -7,10 +7,15 @@
 
 #pragma once
 
-#include <fstream>
 #include <string>
 #include <map>
 #include <memory>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 #include "page.h"
 
@@ -18,10 +23,57 @@ namespace badgerdb {
 
 class FileIterator;
 
+/**
+ * @brief Number of pages whose free space is recorded by one free-space map
+ * page of a PageFile, one byte each.
+ */
+const PageId FSM_ENTRIES_PER_PAGE = Page::DATA_SIZE;
+
+/**
+ * @brief Bytes of free space that one unit of a free-space map entry stands
+ * for.  An entry holds the free space of its page divided by this, rounded
+ * down, so it never overstates the space available.
+ */
+const std::size_t FSM_GRANULARITY = 32;
+
+static_assert(Page::DATA_SIZE / FSM_GRANULARITY <= 255,
+              "Free-space map entries must fit in one byte.");
+
+/**
+ * @brief Number of consecutive page numbers whose largest free-space map entry
+ * is cached together, so that a search can pass over all of them at once.
+ */
+const PageId FSM_BLOCK_PAGES = 256;
+
+/**
+ * @brief Value of FileHeader::magic in every file written by BadgerDB.
+ */
+const std::uint32_t FILE_MAGIC = 0x46424442;
+
+/**
+ * @brief Layout version of the file header and pages written by this code.
+ * Files with another version are rejected on open rather than misread.
+ *
+ * 1: format version in the file header, last used page in the file header.
+ * 2: free-space map pages, the first of them being page 1.
+ * 3: used-slot bitmap and free slot list in the page header, 4 byte slots.
+ */
+const std::uint32_t FILE_FORMAT_VERSION = 3;
+
 /**
  * @brief Header metadata for files on disk which contain pages.
  */
 struct FileHeader {
+  /**
+   * Identifies a BadgerDB file, FILE_MAGIC.
+   */
+  std::uint32_t magic;
+
+  /**
+   * Layout version of the file, FILE_FORMAT_VERSION when written by this code.
+   */
+  std::uint32_t format_version;
+
   /**
    * Number of pages allocated in the file.
    */
@@ -42,6 +94,12 @@ struct FileHeader {
    */
   PageId first_free_page;
 
+  /**
+   * Page number of the last used page in the file, where new pages are
+   * appended to the used list.
+   */
+  PageId last_used_page;
+
   /**
    * Returns true if this file header is equal to the other.
    *
@@ -49,26 +107,127 @@ struct FileHeader {
    * @return  True if the other header is equal to this one.
    */
   bool operator==(const FileHeader& rhs) const {
-    return num_pages == rhs.num_pages &&
+    return magic == rhs.magic &&
+        format_version == rhs.format_version &&
+        num_pages == rhs.num_pages &&
         num_free_pages == rhs.num_free_pages &&
         first_used_page == rhs.first_used_page &&
-        first_free_page == rhs.first_free_page;
+        first_free_page == rhs.first_free_page &&
+        last_used_page == rhs.last_used_page;
   }
 };
 
+/**
+ * @brief State shared by all File objects open on the same underlying file:
+ *        its file descriptor and cached copies of its header and free-space
+ *        map.
+ */
+class OpenFile {
+ public:
+  /**
+   * Takes ownership of an open file descriptor.
+   *
+   * @param fd  File descriptor.
+   */
+  explicit OpenFile(const int fd)
+      : fd_(fd), header_dirty_(false), free_space_loaded_(false) {}
+
+  /**
+   * Writes the cached header and free-space map back if they have changed and
+   * closes the file descriptor.
+   */
+  ~OpenFile();
+
+  /**
+   * Returns the file descriptor.
+   */
+  int fd() const { return fd_; }
+
+ private:
+  OpenFile(const OpenFile&);
+  OpenFile& operator=(const OpenFile&);
+
+  /**
+   * Owned file descriptor.
+   */
+  const int fd_;
+
+  /**
+   * Latch protecting the cached header.
+   */
+  std::mutex header_latch_;
+
+  /**
+   * Cached header of the file.
+   */
+  FileHeader header_;
+
+  /**
+   * True if the cached header has changed since it was written to disk.
+   */
+  bool header_dirty_;
+
+  /**
+   * Writes the parts of the cached free-space map that have changed to their
+   * map pages.  The caller holds free_space_latch_.
+   *
+   * @return  False if the operating system reports an error, with errno set.
+   */
+  bool writeFreeSpaceMap();
+
+  /**
+   * Latch protecting the cached free-space map.
+   */
+  std::mutex free_space_latch_;
+
+  /**
+   * Cached free-space map of a PageFile, one entry for every page number.
+   * Read from the map pages the first time it is used.
+   */
+  std::vector<std::uint8_t> free_space_;
+
+  /**
+   * True once free_space_ has been read from disk.
+   */
+  bool free_space_loaded_;
+
+  /**
+   * For every map page, true if its entries have changed since they were
+   * written to disk.
+   */
+  std::vector<bool> free_space_dirty_;
+
+  /**
+   * For every FSM_BLOCK_PAGES page numbers, an upper bound on their entries in
+   * free_space_.  Raised when an entry grows and lowered to the actual largest
+   * entry when a search finds no page in the block.
+   */
+  std::vector<std::uint8_t> free_space_block_max_;
+
+  friend class File;
+  friend class PageFile;
+};
+
 /**
  * @brief Class which represents a file in the filesystem containing database
  *        pages.
  *
- * The File class wraps a stream to an underlying file on disk.  Files contain
+ * The File class wraps a descriptor of an underlying file on disk.  Files contain
  * fixed-sized pages, and they never deallocate space (though they do reuse
  * deleted pages if possible).  If multiple File objects refer to the same
- * underlying file, they will share the stream in memory.
+ * underlying file, they will share the descriptor.
  * If a file that has already been opened (possibly by another query), then the File class
- * detects this (by looking in the open_streams_ map) and just returns a file object with
- * the already created stream for the file without actually opening the UNIX file again. 
+ * detects this (by looking in the open_files_ map) and just returns a file object with
+ * the already opened descriptor for the file without actually opening the UNIX file again. 
+ *
+ * All I/O uses positional reads and writes, so there is no shared file
+ * position and reading pages is threadsafe.  The file header is kept in
+ * memory and written back by sync() and when the file is last closed.
+ * Writes are not flushed to disk individually; sync() makes them durable.
  *
- * @warning This class is not threadsafe.
+ * @warning Opening and closing files, and allocating, writing and deleting
+ * pages (which update the file header and the used page list) are not
+ * threadsafe and must be serialized by the caller.
  */
 
 
@@ -124,6 +283,15 @@ class File {
    */
   virtual Page allocatePage(PageId &new_page_number) = 0;
 
+  /**
+   * Allocates a new page in the file, building it directly in the given page
+   * object instead of returning a copy.
+   *
+   * @param new_page_number  Number of the new page returned via this reference.
+   * @param new_page         Page object overwritten with the new page.
+   */
+  virtual void allocatePageInto(PageId &new_page_number, Page &new_page) = 0;
+
   /**
    * Reads an existing page from the file.
    *
@@ -134,6 +302,17 @@ class File {
    */
   virtual Page readPage(const PageId page_number) const = 0;
 
+  /**
+   * Reads an existing page from the file directly into the given page object,
+   * such as a buffer pool frame, without an intermediate copy.
+   *
+   * @param page_number   Number of page to read.
+   * @param page          Page object overwritten with the page read.
+   * @throws  InvalidPageException  If the page doesn't exist in the file or is
+   *                                not currently used.
+   */
+  virtual void readPageInto(const PageId page_number, Page &page) const = 0;
+
   /**
    * Writes a page into the file at the given page number.
    * No bounds checking is performed.
@@ -143,6 +322,18 @@ class File {
    */
   virtual void writePage(const PageId page_number, const Page& new_page) = 0;
 
+  /**
+   * Writes pages with consecutive numbers into the file, starting at the given
+   * page number, with as few system calls as possible.
+   * No bounds checking is performed.
+   *
+   * @param first_page_number Number of first page whose contents to replace.
+   * @param pages       Pages to write, in page number order.
+   * @param count       Number of pages to write.
+   */
+  virtual void writePages(const PageId first_page_number, const Page* const* pages,
+                          const std::size_t count) = 0;
+
   /**
    * Deletes a page from the file.
    *
@@ -150,6 +341,33 @@ class File {
    */
   virtual void deletePage(const PageId page_number) = 0;
 
+  /**
+   * Returns the free-space map entry of a page of this file as the page is
+   * now, or 0 if the file keeps no free-space map.
+   *
+   * @param page  Page of this file.
+   * @return  Free-space map entry.
+   */
+  virtual std::uint8_t freeSpaceEntryOf(const Page& page) const { return 0; }
+
+  /**
+   * Records the free-space map entry of a page that has been changed in
+   * memory, as returned by freeSpaceEntryOf().  Only files that keep a
+   * free-space map make use of it.
+   *
+   * @param page_number   Number of page.
+   * @param entry         Free-space map entry.
+   */
+  virtual void recordFreeSpace(const PageId page_number, const std::uint8_t entry) {}
+
+  /**
+   * Writes back the cached header and free-space map and forces all pages
+   * and header updates written so far to disk.
+   *
+   * @throws  FileIOException  If the operating system reports an error.
+   */
+  void sync() const;
+
   /**
    * Returns the name of the file this object represents.
    *
@@ -157,6 +375,15 @@ class File {
    */
   const std::string& filename() const { return filename_; }
 
+  /**
+   * Returns the identifier of this File object, unique among all File objects
+   * created by the process.  Pages are cached in the buffer pool per File
+   * object, keyed by this identifier.
+   *
+   * @return Identifier of file object.
+   */
+  std::uint32_t id() const { return id_; }
+
  	/**
    * Returns pageid of first page in the file.
    *
@@ -172,14 +399,46 @@ class File {
    * @param page_number   Number of page.
    * @return  Position of page in file.
    */
-  static std::streampos pagePosition(const PageId page_number) {
-    return sizeof(FileHeader) + ((page_number - 1) * Page::SIZE);
+  static off_t pagePosition(const PageId page_number) {
+    return sizeof(FileHeader) + ((off_t)(page_number - 1) * Page::SIZE);
   }
 
+  /**
+   * Reads bytes at the given position of the file.  Bytes past the end of
+   * the file read as zero.
+   *
+   * @param position  Offset from the beginning of the file.
+   * @param buffer    Memory the bytes are read into.
+   * @param length    Number of bytes to read.
+   * @throws  FileIOException  If the operating system reports an error.
+   */
+  void readAt(const off_t position, void* buffer, const std::size_t length) const;
+
+  /**
+   * Writes bytes at the given position of the file.
+   *
+   * @param position  Offset from the beginning of the file.
+   * @param buffer    Bytes to write.
+   * @param length    Number of bytes to write.
+   * @throws  FileIOException  If the operating system reports an error.
+   */
+  void writeAt(const off_t position, const void* buffer, const std::size_t length) const;
+
+  /**
+   * Writes the given buffers one after the other at the given position of the
+   * file, with a single system call unless it is interrupted or writes short.
+   *
+   * @param position  Offset from the beginning of the file.
+   * @param parts     Buffers to write; overwritten.
+   * @param count     Number of buffers, at most IOV_MAX.
+   * @throws  FileIOException  If the operating system reports an error.
+   */
+  void writeVectored(off_t position, struct iovec* parts, int count) const;
+
   /**
    * Opens the underlying file named in filename_.
    * This method only opens the file if no other File objects exist that access
-   * the same filesystem file; otherwise, it reuses the existing stream.
+   * the same filesystem file; otherwise, it reuses the existing descriptor.
    *
    * @param create_new  Whether to create a new file.
    * @throws  FileExistsException     If the underlying file exists and
@@ -190,48 +449,59 @@ class File {
   void openIfNeeded(const bool create_new);
 
   /**
-   * Closes the underlying file stream in <stream_>.
+   * Releases the underlying file descriptor in <open_file_>.
    * This method only closes the file if no other File objects exist that access
    * the same file.
    */
   void close();
 
   /**
-   * Reads the header for this file from disk.
+   * Returns the header for this file from its in-memory copy.
    *
    * @return  The file header.
    */
   FileHeader readHeader() const;
 
   /**
-   * Writes the given header to the disk as the header for this file.
+   * Replaces the in-memory header for this file.  It reaches the disk at the
+   * next sync() or when the file is last closed.
    *
    * @param header  File header to write.
    */
   void writeHeader(const FileHeader& header);
 
-  typedef std::map<std::string, std::shared_ptr<std::fstream> > StreamMap;
+  typedef std::map<std::string, std::shared_ptr<OpenFile> > OpenFileMap;
   typedef std::map<std::string, int> CountMap;
 
   /**
-   * Streams for opened files.
+   * Descriptors for opened files.
    */
-  static StreamMap open_streams_;
+  static OpenFileMap open_files_;
 
   /**
    * Counts for opened files.
    */
   static CountMap open_counts_;
 
+  /**
+   * Identifier handed to the next File object constructed.
+   */
+  static std::atomic<std::uint32_t> next_id_;
+
   /**
    * Name of the file this object represents.
    */
   std::string filename_;
 
   /**
-   * Stream for underlying filesystem object.
+   * Identifier of this File object.
+   */
+  std::uint32_t id_;
+
+  /**
+   * Descriptor of underlying filesystem object.
    */
-  std::shared_ptr<std::fstream> stream_;
+  std::shared_ptr<OpenFile> open_file_;
 
   friend class FileIterator;
 };
@@ -249,10 +519,10 @@ class PageFile : public File {
 
   /**
    * Opens the file named fileName and returns the corresponding File object.
-	 * It first checks if the file is already open. If so, then the new File object created uses the same input-output stream to read to or write fom
+	 * It first checks if the file is already open. If so, then the new File object created uses the same file descriptor to read to or write fom
 	 * that already open file. Reference count (open_counts_ static variable inside the File object) is incremented whenever an already open file is
-	 * opened again. Otherwise the UNIX file is actually opened. The fileName and the stream associated with this File object are inserted into the
-	 * open_streams_ map.
+	 * opened again. Otherwise the UNIX file is actually opened. The fileName and the descriptor associated with this File object are inserted into the
+	 * open_files_ map.
    *
    * @param filename  Name of the file.
    * @throws  FileNotFoundException   If the requested file doesn't exist.
@@ -300,6 +570,15 @@ class PageFile : public File {
    */
   Page allocatePage(PageId &new_page_number) override;
 
+  /**
+   * Allocates a new page in the file, building it directly in the given page
+   * object instead of returning a copy.
+   *
+   * @param new_page_number  Number of the new page returned via this reference.
+   * @param new_page         Page object overwritten with the new page.
+   */
+  void allocatePageInto(PageId &new_page_number, Page &new_page) override;
+
   /**
    * Reads an existing page from the file.
    *
@@ -310,6 +589,16 @@ class PageFile : public File {
    */
   Page readPage(const PageId page_number) const override;
 
+  /**
+   * Reads an existing page from the file directly into the given page object.
+   *
+   * @param page_number   Number of page to read.
+   * @param page          Page object overwritten with the page read.
+   * @throws  InvalidPageException  If the page doesn't exist in the file or is
+   *                                not currently used.
+   */
+  void readPageInto(const PageId page_number, Page &page) const override;
+
   /**
    * Writes a page into the file at the given page number.
    * No bounds checking is performed.
@@ -319,6 +608,28 @@ class PageFile : public File {
    */
   void writePage(const PageId page_number, const Page& new_page) override;
 
+  /**
+   * Writes pages with consecutive numbers into the file, starting at the given
+   * page number, with as few system calls as possible.
+   * No bounds checking is performed.
+   *
+   * @param first_page_number Number of first page whose contents to replace.
+   * @param pages       Pages to write, in page number order.
+   * @param count       Number of pages to write.
+   */
+  void writePages(const PageId first_page_number, const Page* const* pages,
+                  const std::size_t count) override;
+
+  /**
+   * Adds filled pages at the end of the file and of the used page list.  The
+   * pages are numbered and linked in place and written with as few system
+   * calls as possible, without being allocated empty first.
+   *
+   * @param new_pages   Pages to add, in order; their headers are overwritten.
+   * @param count       Number of pages.
+   */
+  void appendPages(Page* new_pages, const std::size_t count);
+
   /**
    * Deletes a page from the file.
    *
@@ -326,6 +637,31 @@ class PageFile : public File {
    */
   void deletePage(const PageId page_number) override;
 
+  /**
+   * Records the free space left on a page in the free-space map.  Pages
+   * written to the file are recorded this way as well.
+   *
+   * @param page_number   Number of page.
+   * @param page          Current version of the page.
+   */
+  void updateFreeSpace(const PageId page_number, const Page& page);
+
+  std::uint8_t freeSpaceEntryOf(const Page& page) const override;
+  void recordFreeSpace(const PageId page_number, const std::uint8_t entry) override;
+
+  /**
+   * Returns a used page that has room for a record of the given length
+   * according to the free-space map, so that inserts need not try pages one
+   * by one.  Pages changed in the buffer pool are recorded when they are
+   * unpinned dirty, and again when they are written back.  Concurrent
+   * changes to a page can leave its entry behind until then, so callers
+   * still check Page::hasSpaceForRecord() on the page returned.
+   *
+   * @param bytes   Length of the record to be inserted.
+   * @return  Number of page, or Page::INVALID_NUMBER if no page has room.
+   */
+  PageId findPageWithSpace(const std::size_t bytes);
+
   /**
    * Returns an iterator at the first page in the file.
    *
@@ -344,19 +680,20 @@ class PageFile : public File {
  private:
 
   /**
-   * Reads a page from the file.  If <allow_free> is not set, an exception
-   * will be thrown if the page read from disk is not currently in use.
+   * Reads a page from the file into the given page object.  If <allow_free>
+   * is not set, an exception will be thrown if the page read from disk is not
+   * currently in use.
    *
-   * No bounds checking is performed; the underlying file stream will throw
-   * an exception if the page is past the end of the file.
+   * No bounds checking is performed; a page past the end of the file reads
+   * as zeroes.
    *
    * @param page_number   Number of page to read.
+   * @param page          Page object overwritten with the page read.
    * @param allow_free    Whether to allow reading a free (unused) page.
-   * @return  The page.
    * @throws  InvalidPageException  If the page is free (unused) and
    *                                allow_free is false.
    */
-  Page readPage(const PageId page_number, const bool allow_free) const;
+  void readPageInto(const PageId page_number, Page &page, const bool allow_free) const;
 
   /**
    * Writes a page into the file at the given page number with the given header.
@@ -379,6 +716,63 @@ class PageFile : public File {
    */
   PageHeader readPageHeader(const PageId page_number) const;
 
+  /**
+   * Returns the header to write for a new version of a used page: the header
+   * of the new version with the used list links of the page on disk, which
+   * may have changed since the page was read.
+   *
+   * @param page_number   Number of page to be written.
+   * @param new_page      Page to be written.
+   * @return  Header of page.
+   * @throws  InvalidPageException  If the page has been deleted.
+   */
+  PageHeader headerForWrite(const PageId page_number, const Page& new_page) const;
+
+  /**
+   * Writes only the header of the given page to disk, leaving its record data
+   * and slot table untouched.  No bounds checking is performed.
+   *
+   * @param page_number   Number of page whose header is to be written.
+   * @param header        Header of page.
+   */
+  void writePageHeader(const PageId page_number, const PageHeader& header);
+
+  /**
+   * Returns true if the page number is reserved for a free-space map page.
+   * Map page k is page k * (FSM_ENTRIES_PER_PAGE + 1) + 1 and records the
+   * free space of the FSM_ENTRIES_PER_PAGE pages following it.
+   *
+   * @param page_number   Number of page.
+   * @return  Whether the page is a map page.
+   */
+  static bool isMapPage(const PageId page_number) {
+    return (page_number - 1) % (FSM_ENTRIES_PER_PAGE + 1) == 0;
+  }
+
+  /**
+   * Returns the free-space map entry describing the given page: the space
+   * left for the data of one more record, in units of FSM_GRANULARITY.
+   *
+   * @param page  Page.
+   * @return  Free-space map entry.
+   */
+  static std::uint8_t freeSpaceEntry(const Page& page);
+
+  /**
+   * Sets the free-space map entry of a page.  The caller holds the free-space
+   * latch and has loaded the map.
+   *
+   * @param page_number   Number of page.
+   * @param entry         Free-space map entry.
+   */
+  void setFreeSpaceEntry(const PageId page_number, const std::uint8_t entry);
+
+  /**
+   * Reads the free-space map from the map pages unless it is cached already.
+   * The caller holds the free-space latch.
+   */
+  void loadFreeSpaceMap();
+
   friend class FileIterator;
 };
 
@@ -395,10 +789,10 @@ class BlobFile : public File {
 
   /**
    * Opens the file named fileName and returns the corresponding File object.
-	 * It first checks if the file is already open. If so, then the new File object created uses the same input-output stream to read to or write fom
+	 * It first checks if the file is already open. If so, then the new File object created uses the same file descriptor to read to or write fom
 	 * that already open file. Reference count (open_counts_ static variable inside the File object) is incremented whenever an already open file is
-	 * opened again. Otherwise the UNIX file is actually opened. The fileName and the stream associated with this File object are inserted into the
-	 * open_streams_ map.
+	 * opened again. Otherwise the UNIX file is actually opened. The fileName and the descriptor associated with this File object are inserted into the
+	 * open_files_ map.
    *
    * @param filename  Name of the file.
    * @throws  FileNotFoundException   If the requested file doesn't exist.
@@ -448,6 +842,15 @@ class BlobFile : public File {
    */
   Page allocatePage(PageId &new_page_number) override;
 
+  /**
+   * Allocates a new page in the file, building it directly in the given page
+   * object instead of returning a copy.
+   *
+   * @param new_page_number  Number of the new page returned via this reference.
+   * @param new_page         Page object overwritten with the new page.
+   */
+  void allocatePageInto(PageId &new_page_number, Page &new_page) override;
+
   /**
    * Reads an existing page from the file.
    *
@@ -458,6 +861,16 @@ class BlobFile : public File {
    */
   Page readPage(const PageId page_number) const override;
 
+  /**
+   * Reads an existing page from the file directly into the given page object.
+   *
+   * @param page_number   Number of page to read.
+   * @param page          Page object overwritten with the page read.
+   * @throws  InvalidPageException  If the page doesn't exist in the file or is
+   *                                not currently used.
+   */
+  void readPageInto(const PageId page_number, Page &page) const override;
+
   /**
    * Writes a page into the file at the given page number.
    * No bounds checking is performed.
@@ -467,6 +880,18 @@ class BlobFile : public File {
    */
   void writePage(const PageId page_number, const Page& new_page) override;
 
+  /**
+   * Writes pages with consecutive numbers into the file, starting at the given
+   * page number, with as few system calls as possible.
+   * No bounds checking is performed.
+   *
+   * @param first_page_number Number of first page whose contents to replace.
+   * @param pages       Pages to write, in page number order.
+   * @param count       Number of pages to write.
+   */
+  void writePages(const PageId first_page_number, const Page* const* pages,
+                  const std::size_t count) override;
+
   /**
    * Deletes a page from the file.
    *
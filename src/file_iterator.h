@@ -56,7 +56,8 @@ class FileIterator {
   }
 
   /**
-   * Advances the iterator to the next page in the file.
+   * Advances the iterator to the next page in the file.  Only the header of
+   * the current page is read.
    */
 	inline FileIterator& operator++() {
     assert(file_ != NULL);
@@ -85,24 +86,35 @@ class FileIterator {
    * @return    True if other iterator is equal to this one.
    */
 	inline bool operator==(const FileIterator& rhs) const {
-    return file_->filename() == rhs.file_->filename() &&
-        current_page_number_ == rhs.current_page_number_;
+    // page numbers first, so iterators at different pages compare cheaply
+    return current_page_number_ == rhs.current_page_number_ &&
+        file_->filename() == rhs.file_->filename();
   }
 
 	inline bool operator!=(const FileIterator& rhs) const {
-    return (file_->filename() != rhs.file_->filename()) ||
-        (current_page_number_ != rhs.current_page_number_);
+    return (current_page_number_ != rhs.current_page_number_) ||
+        (file_->filename() != rhs.file_->filename());
   }
 
   /**
    * Dereferences the iterator, returning a copy of the current page in the
-   * file.
+   * file.  This reads the whole page from disk; callers that go through the
+   * buffer pool only need pageNumber().
    *
    * @return  Page in file.
    */
 	inline Page operator*() const
   { return file_->readPage(current_page_number_); }
 
+  /**
+   * Returns the number of the page the iterator is pointing to without
+   * reading the page.
+   *
+   * @return  Page number.
+   */
+	inline PageId pageNumber() const
+  { return current_page_number_; }
+
  private:
   /**
    * File we're iterating over.
@@ -5,65 +5,76 @@
  * Copyright (c) 2012 Database Group, Computer Sciences Department, University of Wisconsin-Madison.
  */
 
+#include <algorithm>
 #include "filescan.h"
 #include "exceptions/end_of_file_exception.h"
 
 namespace badgerdb { 
 
-FileScan::FileScan(const std::string &name, BufMgr *bufferMgr)
+FileScan::FileScan(const std::string &name, BufMgr *bufferMgr, const std::uint32_t ringSize)
 {
   file = new PageFile(name, false);	//dont create new file
 	bufMgr = bufferMgr;
-	curDirtyFlag = false;
-  curPage = NULL;
 	filePageIter = file->begin();
+	curPageNo = Page::INVALID_NUMBER;
+	prefetchAtEnd = false;
+	scanDone = false;
+	readAhead = std::min(FILESCAN_READAHEAD, bufMgr->getNumBufs() / 4);
+
+	ring = NULL;
+	const std::uint32_t frames = std::min(ringSize, bufMgr->getNumBufs() / FILESCAN_RING_DIVISOR);
+	if (frames > 0)
+	{
+		ring = new BufferRing(frames);
+		// pages read ahead must not be recycled before the scan gets to them
+		readAhead = std::min(readAhead, frames / 2);
+	}
 }
 
 FileScan::~FileScan()
 {
   // generally must unpin last page of the scan
-  if (curPage != NULL)
+  if (curPage)
   {
-    bufMgr->unPinPage(file, (*filePageIter).page_number(), curDirtyFlag);
-    curPage = NULL;
-		curDirtyFlag = false;
+    curPage.release();
     filePageIter = file->begin();
   }
+  // flushFile() also cancels read-ahead still pending for the file
   bufMgr->flushFile(file);
   delete file;
+  delete ring;
 }
 
 void FileScan::scanNext(RecordId& outRid)
 {
-  std::string rec;
-
-  if (filePageIter == file->end())
+  if (scanDone)
 	{
 		throw EndOfFileException();
 	}
 
   // special case of the first record of the first page of the file
-  if (curPage == NULL)
+  if (!curPage)
   {
     // need to get the first page of the file
 		filePageIter = file->begin();
     if(filePageIter == file->end())
 		{
+			scanDone = true;
 			throw EndOfFileException();
 		}
 	 
-		// read the first page of the file
-    bufMgr->readPage(file, (*filePageIter).page_number(), curPage); 
-		curDirtyFlag = false;
+		// start reading ahead, then read the first page of the file
+		curPageNo = filePageIter.pageNumber();
+		aheadPages.clear();
+		prefetchAtEnd = false;
+		readAheadPages();
+    readCurrentPage(); 
 
 		// get the first record off the page
     pageRecordIter = curPage->begin(); 
 
 		if(pageRecordIter != curPage->end()) 
 		{
-		  // get pointer to record
-		  rec = *pageRecordIter;
-
 			outRid = pageRecordIter.getCurrentRecord();
 			return;
 		}
@@ -76,34 +87,73 @@ void FileScan::scanNext(RecordId& outRid)
   while (pageRecordIter == curPage->end())
   {
     // unpin the current page
-    bufMgr->unPinPage(file, (*filePageIter).page_number(), curDirtyFlag);
-    curPage = NULL;
-    curDirtyFlag = false;
+    curPage.release();
 
-    filePageIter++;
-    if (filePageIter == file->end())
+    if (!nextPage())
     {
-      curPage = NULL;
+			scanDone = true;
 			throw EndOfFileException();
     }
 
-    // read the next page of the file
-    bufMgr->readPage(file, (*filePageIter).page_number(), curPage);
+    // keep the read-ahead window full, then read the next page of the file
+    readAheadPages();
+    readCurrentPage();
 
     // get the first record off the page
     pageRecordIter = curPage->begin(); 
   }
 
   // curRec points at a valid record
-  // see if the record satisfies the scan's predicate 
-  // get a pointer to the record
-  rec = *pageRecordIter;
-
 	// return rid of the record
 	outRid = pageRecordIter.getCurrentRecord();
 	return;
 }
 
+bool FileScan::nextPage()
+{
+  // the headers of pages read ahead have been read already
+  if (!aheadPages.empty())
+  {
+    curPageNo = aheadPages.front();
+    aheadPages.pop_front();
+    return true;
+  }
+
+  // without read-ahead, follow the link in the header of the current page
+  if (prefetchAtEnd)
+    return false;
+  ++filePageIter;
+  if (filePageIter == file->end())
+    return false;
+  curPageNo = filePageIter.pageNumber();
+  return true;
+}
+
+void FileScan::readCurrentPage()
+{
+  if (ring != NULL)
+    curPage = bufMgr->pinPage(file, curPageNo, *ring);
+  else
+    curPage = bufMgr->pinPage(file, curPageNo, SEQUENTIAL_ACCESS);
+}
+
+void FileScan::readAheadPages()
+{
+  while (!prefetchAtEnd && aheadPages.size() < readAhead)
+  {
+    FileIterator nextIter = filePageIter;
+    ++nextIter;
+    if (nextIter == file->end())
+    {
+      prefetchAtEnd = true;
+      return;
+    }
+    filePageIter = nextIter;
+    bufMgr->prefetchPage(file, filePageIter.pageNumber(), SEQUENTIAL_ACCESS, ring);
+    aheadPages.push_back(filePageIter.pageNumber());
+  }
+}
+
 // returns pointer to the current record.  page is left pinned
 // and the scan logic is required to unpin the page 
 std::string FileScan::getRecord()
@@ -111,10 +161,15 @@ std::string FileScan::getRecord()
   return *pageRecordIter;
 }
 
+RecordView FileScan::getRecordView()
+{
+  return pageRecordIter.recordView();
+}
+
 // mark current page of scan dirty
 void FileScan::markDirty()
 {
-  curDirtyFlag = true;
+  curPage.markDirty();
 }
 
 }
@@ -8,6 +8,7 @@
 
 #pragma once
 
+#include <deque>
 #include <string>
 #include "types.h"
 #include "page.h"
@@ -17,6 +18,17 @@
 
 namespace badgerdb {
 
+/**
+ * @brief Number of pages a FileScan asks the buffer manager to read ahead of
+ * the page it is on.  Capped at a quarter of the buffer pool.
+ */
+const std::uint32_t FILESCAN_READAHEAD = 8;
+
+/**
+ * @brief Largest share of the buffer pool a FileScan ring may take.
+ */
+const std::uint32_t FILESCAN_RING_DIVISOR = 4;
+
 /**
  * @brief This class is used to sequentially scan records in a relation.
  */
@@ -24,16 +36,28 @@ class FileScan
 {
  public:
 
-  FileScan(const std::string &name, BufMgr *bufMgr);
+  /**
+   * Opens a scan of a relation.
+   *
+   * @param name      Name of the relation file
+   * @param bufMgr    Buffer manager to read pages through
+   * @param ringSize  If not 0, pages are read into a private ring of this many
+   *                  frames (at most a quarter of the pool) so the scan does not
+   *                  evict other pages from the buffer pool
+   */
+  FileScan(const std::string &name, BufMgr *bufMgr, const std::uint32_t ringSize = 0);
 
   ~FileScan();
 
   //return RecordId of next record that satisfies the scan 
   void scanNext(RecordId& outRid);
 
-  //read current record, returning pointer and length
+  //read current record, returning a copy of it
   std::string getRecord();
 
+  //read current record, returning pointer and length; valid until the scan moves to the next page
+  RecordView getRecordView();
+
   //marks current page of scan dirty
   void markDirty();
 
@@ -49,17 +73,64 @@ class FileScan
 	BufMgr				*bufMgr;
 
   /**
-   * Current page being scanned.
+   * Current page being scanned, held pinned until the scan moves past it.
    */
-  Page*         curPage;
+  PageHandle    curPage;
 
+  /**
+   * Number of the page being scanned
+   */
+  PageId        curPageNo;
+
+  /**
+   * Last page of the file whose number is known, the current page or the
+   * last page read ahead.  Every page header is read once, by advancing it.
+   */
   FileIterator  filePageIter;
-  PageIterator  pageRecordIter;
 
   /**
-   * True if page has been updated
+   * Pages handed to the buffer manager for read-ahead and not scanned yet, in file order
    */
-  bool  	      curDirtyFlag;
+  std::deque<PageId> aheadPages;
+
+  /**
+   * True once filePageIter has reached the last page of the file
+   */
+  bool          prefetchAtEnd;
+
+  /**
+   * True once the scan has passed the last page of the file
+   */
+  bool          scanDone;
+
+  /**
+   * Number of pages to keep read ahead
+   */
+  std::uint32_t readAhead;
+
+  /**
+   * Private ring of frames the scan reads pages into, or NULL to use the whole pool
+   */
+  BufferRing    *ring;
+
+  /**
+   * Queues prefetches until readAhead pages after the current one are requested.
+   */
+  void readAheadPages();
+
+  /**
+   * Moves curPageNo to the next page of the file, taking it from the pages
+   * read ahead if there are any.
+   *
+   * @return  False if the current page is the last page of the file
+   */
+  bool nextPage();
+
+  /**
+   * Reads and pins page curPageNo into curPage.
+   */
+  void readCurrentPage();
+  PageIterator  pageRecordIter;
 };
 
 }
@@ -6,9 +6,15 @@
  */
 
 #include <vector>
+#include <map>
+#include <set>
+#include <fstream>
+#include <thread>
+#include <atomic>
 #include "btree.h"
 #include "page.h"
 #include "filescan.h"
+#include "relationwriter.h"
 #include "page_iterator.h"
 #include "file_iterator.h"
 #include "exceptions/insufficient_space_exception.h"
@@ -19,6 +25,9 @@
 #include "exceptions/bad_opcodes_exception.h"
 #include "exceptions/scan_not_initialized_exception.h"
 #include "exceptions/end_of_file_exception.h"
+#include "exceptions/bad_file_format_exception.h"
+#include "exceptions/invalid_page_exception.h"
+#include "exceptions/invalid_record_exception.h"
 #include <exceptions/page_pinned_exception.h>
 #include <exceptions/page_not_pinned_exception.h>
 
@@ -76,6 +85,8 @@ void createRelationRandom();
 void createRelationFixSize(int size);
 void createRelationForwardWithSize(int size);
 void intTests();
+void intIndexTests(BTreeIndex *index);
+void bulkLoadTests();
 void testsEmpty();
 int intScan(BTreeIndex *index, int lowVal, Operator lowOp, int highVal, Operator highOp);
 void indexTests();
@@ -83,6 +94,14 @@ void test1();
 void test2();
 void test3();
 void test4();
+void test5();
+void test6();
+void test7();
+void test8();
+void test9();
+void test10();
+int checkPageRecords(Page &page, const std::map<SlotId, std::string> &records);
+void concurrentScan(BufMgr *mgr, const std::vector<PageId> *pageNos, std::atomic<int> *numCorrect);
 void errorTests();
 void deleteRelation();
 
@@ -150,6 +169,12 @@ int main(int argc, char **argv)
 	test3();
 	//test relation size is 0 and we need to check it is empty
 	test4();
+	test5();
+	test6();
+	test7();
+	test8();
+	test9();
+	test10();
 
 
 	errorTests();
@@ -202,6 +227,351 @@ void test4() {
     deleteRelation();
 }
 
+void test5()
+{
+	// Create a relation with tuples valued 0 to relationSize in random order and bulk load
+	// indexes over it, once with sorted runs kept in memory and once spilled to disk
+	std::cout << "--------------------" << std::endl;
+	std::cout << "test5 bulk load" << std::endl;
+	createRelationRandom();
+	bulkLoadTests();
+	deleteRelation();
+}
+
+void test6()
+{
+	// Several threads scan the same relation through one buffer pool much smaller
+	// than the relation, so pages are hit, loaded and evicted concurrently
+	std::cout << "--------------------" << std::endl;
+	std::cout << "test6 concurrent buffer pool access" << std::endl;
+	createRelationForward();
+
+	std::vector<PageId> pageNos;
+	for (FileIterator iter = file1->begin(); iter != file1->end(); ++iter)
+		pageNos.push_back(iter.pageNumber());
+
+	const int numThreads = 4;
+	std::atomic<int> numCorrect(0);
+	{
+		BufMgr sharedBufMgr(8);
+		std::vector<std::thread> threads;
+		for (int i = 0; i < numThreads; i++)
+			threads.push_back(std::thread(concurrentScan, &sharedBufMgr, &pageNos, &numCorrect));
+		for (int i = 0; i < numThreads; i++)
+			threads[i].join();
+		sharedBufMgr.flushFile(file1);
+	}
+	checkPassFail(numCorrect.load(), numThreads)
+	deleteRelation();
+}
+
+void test7()
+{
+	// Run the index tests through a buffer pool using the scan resistant replacement policy
+	std::cout << "--------------------" << std::endl;
+	std::cout << "test7 2Q replacement policy and background writer" << std::endl;
+	BufMgr *clockBufMgr = bufMgr;
+	bufMgr = new BufMgr(100, new TwoQueuePolicy(100));
+	// and with dirty pages written back in the background
+	BackgroundWriterConfig writerConfig;
+	writerConfig.intervalMs = 1;
+	bufMgr->startBackgroundWriter(writerConfig);
+	createRelationRandom();
+	indexTests();
+	deleteRelation();
+	delete bufMgr;
+	bufMgr = clockBufMgr;
+}
+
+void test8()
+{
+	// Delete records in the middle of a page, then insert and grow records that only fit
+	// once the space left between the remaining records is compacted
+	std::cout << "--------------------" << std::endl;
+	std::cout << "test8 page compaction" << std::endl;
+	Page page;
+	std::map<SlotId, std::string> records;
+
+	// fill the page with 100 byte records
+	for (int i = 0; ; i++)
+	{
+		const std::string data(100, (char)('a' + i % 26));
+		if (!page.hasSpaceForRecord(data))
+			break;
+		records[page.insertRecord(data).slot_number] = data;
+	}
+	checkPassFail(checkPageRecords(page, records), 0)
+
+	// delete every other record but the last, leaving holes between the others
+	const SlotId lastSlot = records.rbegin()->first;
+	for (SlotId slot = 2; slot < lastSlot; slot += 2)
+	{
+		page.deleteRecord({page.page_number(), slot, 0});
+		records.erase(slot);
+	}
+	checkPassFail(checkPageRecords(page, records), 0)
+
+	// a record larger than any hole goes into a freed slot
+	const std::string bigData(300, 'X');
+	const RecordId bigRid = page.insertRecord(bigData);
+	records[bigRid.slot_number] = bigData;
+	checkPassFail(checkPageRecords(page, records), 0)
+
+	// growing a record moves it
+	const std::string grownData(250, 'Y');
+	page.updateRecord({page.page_number(), 1, 0}, grownData);
+	records[1] = grownData;
+	checkPassFail(checkPageRecords(page, records), 0)
+}
+
+void test9()
+{
+	// The free-space map of a file finds pages with room for a record, follows pages changed
+	// in the buffer pool, is kept across reopening the file and lives on pages of its own
+	std::cout << "--------------------" << std::endl;
+	std::cout << "test9 free-space map" << std::endl;
+	const std::string fsmName = "relFsm";
+	try
+	{
+		File::remove(fsmName);
+	}
+	catch(const FileNotFoundException &e)
+	{
+	}
+
+	const std::string data(100, 'f');
+	std::vector<PageId> pageNos;
+	PageId roomyPageNo;
+	{
+		PageFile fsmFile = PageFile::create(fsmName);
+		for (int i = 0; i < 5; i++)
+		{
+			PageId pageNo;
+			Page page = fsmFile.allocatePage(pageNo);
+			while (page.hasSpaceForRecord(data))
+				page.insertRecord(data);
+			fsmFile.writePage(pageNo, page);
+			pageNos.push_back(pageNo);
+		}
+		checkPassFail(fsmFile.findPageWithSpace(data.length()), Page::INVALID_NUMBER)
+
+		// free up room on one page through the buffer pool, the map follows when it is unpinned
+		Page *page;
+		bufMgr->readPage(&fsmFile, pageNos[2], page);
+		for (SlotId slot = 2; slot <= 8; slot += 2)
+			page->deleteRecord({pageNos[2], slot, 0});
+		bufMgr->unPinPage(&fsmFile, pageNos[2], true);
+
+		roomyPageNo = fsmFile.findPageWithSpace(300);
+		checkPassFail(roomyPageNo, pageNos[2])
+		bufMgr->readPage(&fsmFile, roomyPageNo, page);
+		checkPassFail(page->hasSpaceForRecord(std::string(300, 'g')), true)
+		bufMgr->unPinPage(&fsmFile, roomyPageNo, false);
+
+		// insert through the pages the map offers until none is left, without writing them back;
+		// a page that has been filled is not offered again
+		int numFilled = 0;
+		for (PageId pageNo = fsmFile.findPageWithSpace(data.length());
+		     pageNo != Page::INVALID_NUMBER && numFilled < 10;
+		     pageNo = fsmFile.findPageWithSpace(data.length()))
+		{
+			bufMgr->readPage(&fsmFile, pageNo, page);
+			while (page->hasSpaceForRecord(data))
+				page->insertRecord(data);
+			bufMgr->unPinPage(&fsmFile, pageNo, true);
+			numFilled++;
+		}
+		checkPassFail(numFilled, 1)
+
+		// written back, the map keeps the page as it was last unpinned
+		bufMgr->flushFile(&fsmFile);
+		checkPassFail(fsmFile.findPageWithSpace(data.length()), Page::INVALID_NUMBER)
+
+		// make room again for the checks after reopening the file
+		bufMgr->readPage(&fsmFile, pageNos[2], page);
+		for (SlotId slot = 2; slot <= 8; slot += 2)
+			page->deleteRecord({pageNos[2], slot, 0});
+		bufMgr->unPinPage(&fsmFile, pageNos[2], true);
+		bufMgr->flushFile(&fsmFile);
+	}
+
+	{
+		PageFile fsmFile = PageFile::open(fsmName);
+		checkPassFail(fsmFile.findPageWithSpace(300), roomyPageNo)
+
+		// a deleted page has no space to offer
+		fsmFile.deletePage(roomyPageNo);
+		checkPassFail(fsmFile.findPageWithSpace(300), Page::INVALID_NUMBER)
+
+		// allocate pages past the second map page; no map page is handed out or readable
+		const PageId secondMapPageNo = FSM_ENTRIES_PER_PAGE + 2;
+		int numMapPages = 0;
+		PageId pageNo = 0;
+		std::vector<PageId> newPageNos;
+		while (pageNo < secondMapPageNo + 2)
+		{
+			fsmFile.allocatePage(pageNo);
+			newPageNos.push_back(pageNo);
+			if (pageNo == 1 || pageNo == secondMapPageNo)
+				numMapPages++;
+		}
+		checkPassFail(numMapPages, 0)
+
+		// the search passes over pages without space, also once it has given up on them before
+		for (std::size_t i = 0; i + 1 < newPageNos.size(); i++)
+			fsmFile.deletePage(newPageNos[i]);
+		checkPassFail(fsmFile.findPageWithSpace(300), newPageNos.back())
+		fsmFile.deletePage(newPageNos.back());
+		checkPassFail(fsmFile.findPageWithSpace(300), Page::INVALID_NUMBER)
+		fsmFile.allocatePage(pageNo);
+		checkPassFail(fsmFile.findPageWithSpace(300), pageNo)
+
+		int numRejected = 0;
+		const PageId mapPageNos[2] = {1, secondMapPageNo};
+		for (int i = 0; i < 2; i++)
+		{
+			try
+			{
+				fsmFile.readPage(mapPageNos[i]);
+			}
+			catch(const InvalidPageException &e)
+			{
+				numRejected++;
+			}
+		}
+		checkPassFail(numRejected, 2)
+	}
+	File::remove(fsmName);
+}
+
+void test10()
+{
+	// Freed slots are reused last freed first, trailing free slots are given back, and
+	// the iterator finds the used slots through the bitmap of the page header
+	std::cout << "--------------------" << std::endl;
+	std::cout << "test10 page slots" << std::endl;
+	const std::string data(10, 's');
+	{
+		Page page;
+		for (int i = 0; i < 5; i++)
+			page.insertRecord(data);
+		page.deleteRecord({page.page_number(), 2, 0});
+		page.deleteRecord({page.page_number(), 4, 0});
+		checkPassFail(page.insertRecord(data).slot_number, 4)
+		checkPassFail(page.insertRecord(data).slot_number, 2)
+		checkPassFail(page.insertRecord(data).slot_number, 6)
+	}
+
+	{
+		// freeing the last slot gives back the free slots before it, and takes them off the free list
+		Page page;
+		std::map<SlotId, std::string> records;
+		for (int i = 0; i < 5; i++)
+			records[page.insertRecord(data).slot_number] = data;
+		for (SlotId slot = 3; slot <= 5; slot++)
+		{
+			page.deleteRecord({page.page_number(), slot, 0});
+			records.erase(slot);
+		}
+		checkPassFail(checkPageRecords(page, records), 0)
+		checkPassFail(page.insertRecord(data).slot_number, 3)
+		checkPassFail(page.insertRecord(data).slot_number, 4)
+	}
+
+	{
+		// keep records on both sides of 64 slot words of the bitmap
+		Page page;
+		std::map<SlotId, std::string> records;
+		for (int i = 0; i < 200; i++)
+			records[page.insertRecord(data).slot_number] = data;
+		const SlotId kept[] = {1, 63, 64, 65, 128, 129, 192, 200};
+		const std::set<SlotId> keptSlots(kept, kept + sizeof(kept) / sizeof(kept[0]));
+		for (SlotId slot = 1; slot <= 200; slot++)
+		{
+			if (keptSlots.count(slot) == 0)
+			{
+				page.deleteRecord({page.page_number(), slot, 0});
+				records.erase(slot);
+			}
+		}
+		std::vector<SlotId> slots;
+		for (PageIterator iter = page.begin(); iter != page.end(); ++iter)
+			slots.push_back(iter.getCurrentRecord().slot_number);
+		const bool sameSlots = (slots == std::vector<SlotId>(keptSlots.begin(), keptSlots.end()));
+		checkPassFail(sameSlots, true)
+		checkPassFail(checkPageRecords(page, records), 0)
+
+		// slot numbers outside the slots of the page are no records
+		int numRejected = 0;
+		const SlotId badSlots[] = {Page::INVALID_SLOT, 201, 1000};
+		for (int i = 0; i < 3; i++)
+		{
+			try
+			{
+				page.getRecord({page.page_number(), badSlots[i], 0});
+			}
+			catch(const InvalidRecordException &e)
+			{
+				numRejected++;
+			}
+		}
+		checkPassFail(numRejected, 3)
+	}
+}
+
+/**
+ * Compares the records of a page and its free space with the expected ones.
+ * @param page     page to check
+ * @param records  expected records by slot number, the last one being the last slot of the page
+ * @return         number of differences
+ */
+int checkPageRecords(Page &page, const std::map<SlotId, std::string> &records)
+{
+	int differences = 0;
+	std::size_t liveBytes = 0;
+	std::size_t numRecords = 0;
+	for (PageIterator iter = page.begin(); iter != page.end(); ++iter)
+	{
+		const SlotId slot = iter.getCurrentRecord().slot_number;
+		std::map<SlotId, std::string>::const_iterator expected = records.find(slot);
+		if (expected == records.end() || *iter != expected->second)
+			differences++;
+		numRecords++;
+	}
+	for (std::map<SlotId, std::string>::const_iterator it = records.begin(); it != records.end(); ++it)
+	{
+		if (page.getRecord({page.page_number(), it->first, 0}) != it->second)
+			differences++;
+		liveBytes += it->second.length();
+	}
+	if (numRecords != records.size())
+		differences++;
+
+	// every slot up to the last record is kept, the rest of the page is free
+	const std::size_t numSlots = records.empty() ? 0 : records.rbegin()->first;
+	if (page.getFreeSpace() != Page::DATA_SIZE - numSlots * sizeof(PageSlot) - liveBytes)
+		differences++;
+	return differences;
+}
+
+void concurrentScan(BufMgr *mgr, const std::vector<PageId> *pageNos, std::atomic<int> *numCorrect)
+{
+	long long sum = 0;
+	for (int pass = 0; pass < 5; pass++)
+	{
+		for (std::size_t i = 0; i < pageNos->size(); i++)
+		{
+			Page *page;
+			mgr->readPage(file1, (*pageNos)[i], page);
+			for (PageIterator iter = page->begin(); iter != page->end(); ++iter)
+				sum += reinterpret_cast<const RECORD*>((*iter).data())->i;
+			mgr->unPinPage(file1, (*pageNos)[i], false);
+		}
+	}
+	if (sum == 5LL * relationSize * (relationSize - 1) / 2)
+		(*numCorrect)++;
+}
+
 // -----------------------------------------------------------------------------
 // createRelationForward
 // -----------------------------------------------------------------------------
@@ -224,33 +594,19 @@ void createRelationForward()
 
   // initialize all of record1.s to keep purify happy
   memset(record1.s, ' ', sizeof(record1.s));
-	PageId new_page_number;
-  Page new_page = file1->allocatePage(new_page_number);
+	std::vector<RECORD> records(relationSize, record1);
 
-  // Insert a bunch of tuples into the relation.
+  // Insert a bunch of tuples into the relation, all in one batch.
   for(int i = 0; i < relationSize; i++ )
 	{
-    sprintf(record1.s, "%05d string record", i);
-    record1.i = i;
-    record1.d = (double)i;
-    std::string new_data(reinterpret_cast<char*>(&record1), sizeof(record1));
-
-		while(1)
-		{
-			try
-			{
-    		new_page.insertRecord(new_data);
-				break;
-			}
-			catch(const InsufficientSpaceException &e)
-			{
-				file1->writePage(new_page_number, new_page);
-  			new_page = file1->allocatePage(new_page_number);
-			}
-		}
+    sprintf(records[i].s, "%05d string record", i);
+    records[i].i = i;
+    records[i].d = (double)i;
   }
 
-	file1->writePage(new_page_number, new_page);
+	RelationWriter writer(file1);
+	writer.append(reinterpret_cast<char*>(records.data()), sizeof(RECORD), records.size());
+	writer.flush();
 }
 
 // -----------------------------------------------------------------------------
@@ -271,8 +627,7 @@ void createRelationBackward()
 
   // initialize all of record1.s to keep purify happy
   memset(record1.s, ' ', sizeof(record1.s));
-	PageId new_page_number;
-  Page new_page = file1->allocatePage(new_page_number);
+	RelationWriter writer(file1);
 
   // Insert a bunch of tuples into the relation.
   for(int i = relationSize - 1; i >= 0; i-- )
@@ -281,24 +636,9 @@ void createRelationBackward()
     record1.i = i;
     record1.d = i;
 
-    std::string new_data(reinterpret_cast<char*>(&record1), sizeof(RECORD));
-
-		while(1)
-		{
-			try
-			{
-    		new_page.insertRecord(new_data);
-				break;
-			}
-			catch(const InsufficientSpaceException &e)
-			{
-				file1->writePage(new_page_number, new_page);
-  			new_page = file1->allocatePage(new_page_number);
-			}
-		}
+		writer.append(reinterpret_cast<char*>(&record1), sizeof(RECORD));
   }
-
-	file1->writePage(new_page_number, new_page);
+	writer.flush();
 }
 
 // -----------------------------------------------------------------------------
@@ -444,14 +784,58 @@ void intTests()
   std::cout << "Create a B+ Tree index on the integer field" << std::endl;
   BTreeIndex index(relationName, intIndexName, bufMgr, offsetof(tuple,i), INTEGER);
 
+	intIndexTests(&index);
+}
+
+void intIndexTests(BTreeIndex *index)
+{
 	// run some tests
-	checkPassFail(intScan(&index,25,GT,40,LT), 14)
-	checkPassFail(intScan(&index,20,GTE,35,LTE), 16)
-	checkPassFail(intScan(&index,-3,GT,3,LT), 3)
-	checkPassFail(intScan(&index,996,GT,1001,LT), 4)
-	checkPassFail(intScan(&index,0,GT,1,LT), 0)
-	checkPassFail(intScan(&index,300,GT,400,LT), 99)
-	checkPassFail(intScan(&index,3000,GTE,4000,LT), 1000)
+	checkPassFail(intScan(index,25,GT,40,LT), 14)
+	checkPassFail(intScan(index,20,GTE,35,LTE), 16)
+	checkPassFail(intScan(index,-3,GT,3,LT), 3)
+	checkPassFail(intScan(index,996,GT,1001,LT), 4)
+	checkPassFail(intScan(index,0,GT,1,LT), 0)
+	checkPassFail(intScan(index,300,GT,400,LT), 99)
+	checkPassFail(intScan(index,3000,GTE,4000,LT), 1000)
+}
+
+// -----------------------------------------------------------------------------
+// bulkLoadTests
+// -----------------------------------------------------------------------------
+
+void bulkLoadTests()
+{
+	// drop the index left behind by earlier tests so that it gets rebuilt
+	try
+	{
+		File::remove(intIndexName);
+	}
+	catch(const FileNotFoundException &e)
+	{
+	}
+
+	{
+		std::cout << "Bulk load a B+ Tree index on the integer field, half full nodes" << std::endl;
+		BTreeIndex index(relationName, intIndexName, bufMgr, offsetof(tuple,i), INTEGER, true, 0.5);
+		intIndexTests(&index);
+
+		// entries inserted after the build land in the packed leaves
+		RecordId newRid = {file1->getFirstPageNo(), 1, 0};
+		int key = relationSize;
+		index.insertEntry(&key, newRid);
+		checkPassFail(intScan(&index,relationSize - 10,GTE,relationSize,LTE), 11)
+	}
+	File::remove(intIndexName);
+
+	{
+		// a pool this small cannot hold all keys so sorted runs spill to a temporary file
+		std::cout << "Bulk load a B+ Tree index on the integer field, external sort" << std::endl;
+		BufMgr smallBufMgr(5);
+		BTreeIndex index(relationName, intIndexName, &smallBufMgr, offsetof(tuple,i), INTEGER, true);
+		intIndexTests(&index);
+	}
+	bufMgr->flushFile(file1);
+	File::remove(intIndexName);
 }
 
 void testsEmpty() {
@@ -645,6 +1029,26 @@ void errorTests()
 		deleteRelation();
 	}
 
+	{
+		std::cout << "Open a file written in an older format" << std::endl;
+		{
+			// header of a file without magic and format version: 1 page, no used or free pages
+			const PageId oldHeader[5] = {1, 0, 0, 0, 0};
+			std::ofstream oldFile(relationName.c_str(), std::ios::binary | std::ios::trunc);
+			oldFile.write(reinterpret_cast<const char*>(oldHeader), sizeof(oldHeader));
+		}
+		try
+		{
+			PageFile oldFile = PageFile::open(relationName);
+			std::cout << "BadFileFormatException Test 1 Failed." << std::endl;
+		}
+		catch(const BadFileFormatException &e)
+		{
+			std::cout << "BadFileFormatException Test 1 Passed." << std::endl;
+		}
+		File::remove(relationName);
+	}
+
 	try
 	{
 		File::remove(intIndexName);
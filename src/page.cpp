@@ -5,6 +5,7 @@
  * Copyright (c) 2012 Database Group, Computer Sciences Department, University of Wisconsin-Madison.
  */
 
+#include <algorithm>
 #include <cassert>
 
 #include <iostream>
@@ -27,8 +28,12 @@ void Page::initialize() {
   header_.free_space_upper_bound = DATA_SIZE;
   header_.num_slots = 0;
   header_.num_free_slots = 0;
+  header_.dead_space = 0;
+  header_.first_free_slot = INVALID_SLOT;
+  memset(header_.used_slots, 0, sizeof(header_.used_slots));
   header_.current_page_number = INVALID_NUMBER;
   header_.next_page_number = INVALID_NUMBER;
+  header_.prev_page_number = INVALID_NUMBER;
   //data_.assign(DATA_SIZE, char());
 	memset(data_, '\0', DATA_SIZE);
 }
@@ -38,17 +43,73 @@ RecordId Page::insertRecord(const std::string& record_data) {
     throw InsufficientSpaceException(
         page_number(), record_data.length(), getFreeSpace());
   }
+  // a new slot takes contiguous space from the free space as well
+  reserveContiguousSpace(record_data.length() +
+                         (header_.num_free_slots == 0 ? sizeof(PageSlot) : 0));
   const SlotId slot_number = getAvailableSlot();
   insertRecordInSlot(slot_number, record_data);
   return {page_number(), slot_number};
 }
 
+std::size_t Page::appendRecords(const char* records,
+                                const std::size_t record_length,
+                                const std::size_t count) {
+  compact();
+  const std::size_t fit = std::min(
+      count, static_cast<std::size_t>(header_.free_space_upper_bound -
+                                      header_.free_space_lower_bound) /
+                 (record_length + sizeof(PageSlot)));
+  if (fit == 0) {
+    return 0;
+  }
+
+  // Records keep their order on the page, so their data is copied in one go.
+  const std::uint16_t first_offset =
+      header_.free_space_upper_bound - fit * record_length;
+  for (std::size_t i = 0; i < fit; ++i) {
+    setSlotUsed(header_.num_slots + 1 + i, true);
+    PageSlot* slot = getSlot(header_.num_slots + 1 + i);
+    slot->item_offset = first_offset + i * record_length;
+    slot->item_length = record_length;
+  }
+  memcpy(&data_[first_offset], records, fit * record_length);
+
+  header_.num_slots += fit;
+  header_.free_space_lower_bound = sizeof(PageSlot) * header_.num_slots;
+  header_.free_space_upper_bound = first_offset;
+  return fit;
+}
+
+std::size_t Page::appendRecords(const RecordView* records,
+                                const std::size_t count) {
+  compact();
+  std::size_t appended = 0;
+  while (appended < count &&
+         records[appended].length + sizeof(PageSlot) <=
+             static_cast<std::size_t>(header_.free_space_upper_bound -
+                                      header_.free_space_lower_bound)) {
+    const RecordView& record = records[appended];
+    ++header_.num_slots;
+    header_.free_space_lower_bound = sizeof(PageSlot) * header_.num_slots;
+    header_.free_space_upper_bound -= record.length;
+    setSlotUsed(header_.num_slots, true);
+    PageSlot* slot = getSlot(header_.num_slots);
+    slot->item_offset = header_.free_space_upper_bound;
+    slot->item_length = record.length;
+    memcpy(&data_[slot->item_offset], record.data, record.length);
+    ++appended;
+  }
+  return appended;
+}
+
 std::string Page::getRecord(const RecordId& record_id) const {
+  return getRecordView(record_id).toString();
+}
+
+RecordView Page::getRecordView(const RecordId& record_id) const {
   validateRecordId(record_id);
   const PageSlot& slot = getSlot(record_id.slot_number);
-	std::string retStr = std::string(data_, DATA_SIZE).substr(slot.item_offset, slot.item_length);
-
-	return retStr;
+  return {&data_[slot.item_offset], slot.item_length};
 }
 
 void Page::updateRecord(const RecordId& record_id,
@@ -77,59 +138,36 @@ void Page::deleteRecord(const RecordId& record_id,
   validateRecordId(record_id);
   PageSlot* slot = getSlot(record_id.slot_number);
 
-	for(int i = 0; i < slot->item_length; i++)
-		data_[i + slot->item_offset] = '\0';
-
-  //data_.replace(slot->item_offset, slot->item_length, slot->item_length, '\0');
-
-  // Compact the data by removing the hole left by this record (if necessary).
-  std::uint16_t move_offset = slot->item_offset; 
-  std::size_t move_bytes = 0;
-  for (SlotId i = 1; i <= header_.num_slots; ++i) {
-    PageSlot* other_slot = getSlot(i);
-    if (other_slot->used && other_slot->item_offset < slot->item_offset) {
-      if (other_slot->item_offset < move_offset) {
-        move_offset = other_slot->item_offset;
-      }
-      move_bytes += other_slot->item_length;
-      // Update the slot for the other data to reflect the soon-to-be-new
-      // location.
-      other_slot->item_offset += slot->item_length;
-    }
-  }
-  // If we have data to move, shift it to the right.
-  if (move_bytes > 0) {
-    const std::string& data_to_move = std::string(data_, DATA_SIZE).substr(move_offset, move_bytes);
-
-		for(std::uint16_t i = 0; i < move_bytes; i++)
-			data_[i + move_offset + slot->item_length] = data_to_move[i];
-
-    //data_.replace(move_offset + slot->item_length, move_bytes, data_to_move);
+  // Data next to the free space is given back right away, any other hole is
+  // left for compaction to reclaim when an insert needs the space.
+  if (slot->item_offset == header_.free_space_upper_bound) {
+    header_.free_space_upper_bound += slot->item_length;
+  } else {
+    header_.dead_space += slot->item_length;
   }
-  header_.free_space_upper_bound += slot->item_length;
 
-  // Mark slot as unused.
-  slot->used = false;
-  slot->item_offset = 0;
+  // Mark slot as unused and push it on the free slot list.
+  setSlotUsed(record_id.slot_number, false);
+  slot->item_offset = header_.first_free_slot;
   slot->item_length = 0;
+  header_.first_free_slot = record_id.slot_number;
   ++header_.num_free_slots;
 
   if (allow_slot_compaction && record_id.slot_number == header_.num_slots) {
     // Last slot in the list, so we need to free any unused slots that are at
-    // the end of the slot list.
-    int num_slots_to_delete = 1;
-    for (SlotId i = 1; i < header_.num_slots; ++i) {
-      // Traverse list backwards, looking for unused slots.
-      const PageSlot* other_slot = getSlot(header_.num_slots - i);
-      if (!other_slot->used) {
-        ++num_slots_to_delete;
+    // the end of the slot list.  We can't move used slots without affecting
+    // record IDs, so everything after the last used slot goes.
+    const SlotId new_num_slots = lastUsedSlot();
+    const int num_slots_to_delete = header_.num_slots - new_num_slots;
+    SlotId* link = &header_.first_free_slot;
+    while (*link != INVALID_SLOT) {
+      if (*link > new_num_slots) {
+        *link = getSlot(*link)->item_offset;
       } else {
-        // Stop at the first used slot we find, since we can't move used slots
-        // without affecting record IDs.
-        break;
+        link = &getSlot(*link)->item_offset;
       }
     }
-    header_.num_slots -= num_slots_to_delete;
+    header_.num_slots = new_num_slots;
     header_.num_free_slots -= num_slots_to_delete;
     header_.free_space_lower_bound -= sizeof(PageSlot) * num_slots_to_delete;
   }
@@ -143,6 +181,44 @@ bool Page::hasSpaceForRecord(const std::string& record_data) const {
   return record_size <= getFreeSpace();
 }
 
+void Page::compact() {
+  if (header_.dead_space == 0) {
+    return;
+  }
+
+  // Slide the records towards the end of the page, highest offset first, so
+  // that every record only moves up over space already vacated.
+  SlotId used_slots[DATA_SIZE / sizeof(PageSlot)];
+  std::size_t num_used = 0;
+  for (SlotId i = nextUsedSlot(INVALID_SLOT); i != INVALID_SLOT;
+       i = nextUsedSlot(i)) {
+    used_slots[num_used++] = i;
+  }
+  std::sort(used_slots, used_slots + num_used,
+            [this](const SlotId a, const SlotId b) {
+              return getSlot(a)->item_offset > getSlot(b)->item_offset;
+            });
+
+  std::size_t end = DATA_SIZE;
+  for (std::size_t i = 0; i < num_used; ++i) {
+    PageSlot* slot = getSlot(used_slots[i]);
+    end -= slot->item_length;
+    if (slot->item_offset != end) {
+      memmove(&data_[end], &data_[slot->item_offset], slot->item_length);
+      slot->item_offset = end;
+    }
+  }
+  header_.free_space_upper_bound = end;
+  header_.dead_space = 0;
+}
+
+void Page::reserveContiguousSpace(const std::size_t bytes) {
+  if (bytes > static_cast<std::size_t>(header_.free_space_upper_bound -
+                                       header_.free_space_lower_bound)) {
+    compact();
+  }
+}
+
 PageSlot* Page::getSlot(const SlotId slot_number) {
   return reinterpret_cast<PageSlot*>(&data_[(slot_number - 1) * sizeof(PageSlot)]);
 }
@@ -151,28 +227,58 @@ const PageSlot& Page::getSlot(const SlotId slot_number) const {
   return *reinterpret_cast<const PageSlot*>(&data_[(slot_number - 1) * sizeof(PageSlot)]);
 }
 
-SlotId Page::getAvailableSlot() {
-  SlotId slot_number = INVALID_SLOT;
-  if (header_.num_free_slots > 0) {
-    // Have an allocated but unused slot that we can reuse.
-    for (SlotId i = 1; i <= header_.num_slots; ++i) {
-      const PageSlot* slot = getSlot(i);
-      if (!slot->used) {
-        // We don't decrement the number of free slots until someone actually
-        // puts data in the slot.
-        slot_number = i;
-        break;
-      }
+SlotId Page::nextUsedSlot(const SlotId start) const {
+  // Bit i of the bitmap stands for slot i + 1, so the search starts at bit
+  // number start.
+  std::size_t word = start / 64;
+  if (word >= MAX_PAGE_SLOTS / 64) {
+    return INVALID_SLOT;
+  }
+  std::uint64_t bits = header_.used_slots[word] & (~std::uint64_t(0) << (start % 64));
+  while (bits == 0) {
+    if (++word == MAX_PAGE_SLOTS / 64) {
+      return INVALID_SLOT;
     }
-  } else {
-    // Have to allocate a new slot.
-    slot_number = header_.num_slots + 1;
+    bits = header_.used_slots[word];
+  }
+  return word * 64 + __builtin_ctzll(bits) + 1;
+}
+
+SlotId Page::lastUsedSlot() const {
+  for (std::size_t word = (header_.num_slots + 63) / 64; word > 0; --word) {
+    const std::uint64_t bits = header_.used_slots[word - 1];
+    if (bits != 0) {
+      return word * 64 - __builtin_clzll(bits);
+    }
+  }
+  return INVALID_SLOT;
+}
+
+void Page::unlinkFreeSlot(const SlotId slot_number) {
+  SlotId* link = &header_.first_free_slot;
+  while (*link != slot_number) {
+    assert(*link != INVALID_SLOT);
+    link = &getSlot(*link)->item_offset;
+  }
+  *link = getSlot(slot_number)->item_offset;
+}
+
+SlotId Page::getAvailableSlot() {
+  if (header_.num_free_slots == 0) {
+    // Have to allocate a new slot.  It is carved out of free space, which may
+    // hold stale bytes, and becomes the only entry of the free slot list.
     ++header_.num_slots;
     ++header_.num_free_slots;
     header_.free_space_lower_bound = sizeof(PageSlot) * header_.num_slots;
+    PageSlot* slot = getSlot(header_.num_slots);
+    slot->item_offset = header_.first_free_slot;
+    slot->item_length = 0;
+    header_.first_free_slot = header_.num_slots;
   }
-  assert(slot_number != INVALID_SLOT);
-  return slot_number;
+  // We don't decrement the number of free slots until someone actually puts
+  // data in the slot.
+  assert(header_.first_free_slot != INVALID_SLOT);
+  return header_.first_free_slot;
 }
 
 void Page::insertRecordInSlot(const SlotId slot_number,
@@ -181,29 +287,29 @@ void Page::insertRecordInSlot(const SlotId slot_number,
       slot_number == INVALID_SLOT) {
     throw InvalidSlotException(page_number(), slot_number);
   }
-  PageSlot* slot = getSlot(slot_number);
-  if (slot->used) {
+  if (isSlotUsed(slot_number)) {
     throw SlotInUseException(page_number(), slot_number);
   }
   const int record_length = record_data.length();
-  slot->used = true;
+  reserveContiguousSpace(record_length);
+  unlinkFreeSlot(slot_number);
+  setSlotUsed(slot_number, true);
+  PageSlot* slot = getSlot(slot_number);
   slot->item_length = record_length;
   slot->item_offset = header_.free_space_upper_bound - record_length;
   header_.free_space_upper_bound = slot->item_offset;
   --header_.num_free_slots;
 
-	for(int i = 0; i < slot->item_length; i++)
-		data_[i + slot->item_offset] = record_data[i];
-
-  //data_.replace(slot->item_offset, slot->item_length, record_data);
+  memcpy(&data_[slot->item_offset], record_data.data(), record_length);
 }
 
 void Page::validateRecordId(const RecordId& record_id) const {
   if (record_id.page_number != page_number()) {
     throw InvalidRecordException(record_id, page_number());
   }
-  const PageSlot& slot = getSlot(record_id.slot_number);
-  if (!slot.used) {
+  if (record_id.slot_number == INVALID_SLOT ||
+      record_id.slot_number > header_.num_slots ||
+      !isSlotUsed(record_id.slot_number)) {
     throw InvalidRecordException(record_id, page_number());
   }
 }
@@ -17,11 +17,17 @@
 
 namespace badgerdb {
 
+/**
+ * @brief Largest number of slots a page can have, the size of the used-slot
+ * bitmap in its header.
+ */
+const std::size_t MAX_PAGE_SLOTS = 2048;
+
 /**
  * @brief Header metadata in a page.
  *
  * Header metadata in each page which tracks where space has been used and
- * contains a pointer to the next page in the file.
+ * contains pointers to the next and previous used pages in the file.
  */
 struct PageHeader {
   /**
@@ -48,6 +54,18 @@ struct PageHeader {
    */
   SlotId num_free_slots;
 
+  /**
+   * Bytes of deleted record data left between live records.  They count as
+   * free space but are only reclaimed when the page is compacted.
+   */
+  std::uint16_t dead_space;
+
+  /**
+   * First slot of the list of allocated slots not in use, linked through
+   * their PageSlot::item_offset, or Page::INVALID_SLOT if there are none.
+   */
+  SlotId first_free_slot;
+
   /**
    * Number of the page within the file.
    */
@@ -58,6 +76,17 @@ struct PageHeader {
    */
   PageId next_page_number;
 
+  /**
+   * Number of the previous used page in the file.
+   */
+  PageId prev_page_number;
+
+  /**
+   * One bit for every slot, set if the slot holds a record.  Bit i stands
+   * for slot i + 1.
+   */
+  std::uint64_t used_slots[MAX_PAGE_SLOTS / 64];
+
   /**
    * Returns true if this page header is equal to the other.
    *
@@ -68,7 +97,8 @@ struct PageHeader {
     return num_slots == rhs.num_slots &&
         num_free_slots == rhs.num_free_slots &&
         current_page_number == rhs.current_page_number &&
-        next_page_number == rhs.next_page_number;
+        next_page_number == rhs.next_page_number &&
+        prev_page_number == rhs.prev_page_number;
   }
 };
 
@@ -77,13 +107,9 @@ struct PageHeader {
  */
 struct PageSlot {
   /**
-   * Whether the slot currently holds data.  May be false if this slot's
-   * record has been deleted after insertion.
-   */
-  bool used;
-
-  /**
-   * Offset of the data item in the page.
+   * Offset of the data item in the page.  For a slot that is not in use
+   * (see PageHeader::used_slots), number of the next slot in the free slot
+   * list instead.
    */
   std::uint16_t item_offset;
 
@@ -93,6 +119,32 @@ struct PageSlot {
   std::uint16_t item_length;
 };
 
+/**
+ * @brief Read-only view of the bytes of a record stored on a page.
+ *
+ * The view points into the page it was taken from, so nothing is copied.  It
+ * is only valid while that page stays pinned in the buffer pool and the record
+ * is neither updated nor deleted.
+ */
+struct RecordView {
+  /**
+   * First byte of the record.
+   */
+  const char* data;
+
+  /**
+   * Length of the record in bytes.
+   */
+  std::size_t length;
+
+  /**
+   * Returns a copy of the record, which outlives the page.
+   *
+   * @return  Bytes of the record.
+   */
+  std::string toString() const { return std::string(data, length); }
+};
+
 class PageIterator;
 
 /**
@@ -141,6 +193,29 @@ class Page {
    */
   RecordId insertRecord(const std::string& record_data);
 
+  /**
+   * Appends records of the same length to the page, as many as fit, in new
+   * slots following the existing ones.  Meant for loading pages: no free slot
+   * is searched for and the data of all records is copied at once.
+   *
+   * @param records         Bytes of the records, one after the other.
+   * @param record_length   Length of each record in bytes.
+   * @param count           Number of records.
+   * @return  Number of records appended, from the front of <records>.
+   */
+  std::size_t appendRecords(const char* records, const std::size_t record_length,
+                            const std::size_t count);
+
+  /**
+   * Appends records of any length to the page, as many as fit in order, in
+   * new slots following the existing ones.
+   *
+   * @param records   Records to append.
+   * @param count     Number of records.
+   * @return  Number of records appended, from the front of <records>.
+   */
+  std::size_t appendRecords(const RecordView* records, const std::size_t count);
+
   /**
    * Returns the record with the given ID.  Returned data is a copy of what is
    * stored on the page; use updateRecord to change it.
@@ -151,6 +226,15 @@ class Page {
    */
   std::string getRecord(const RecordId& record_id) const;
 
+  /**
+   * Returns a view of the record with the given ID, without copying it.
+   *
+   * @see RecordView
+   * @param record_id  ID of the record to return.
+   * @return  View of the record on this page.
+   */
+  RecordView getRecordView(const RecordId& record_id) const;
+
   /**
    * Updates the record with the given ID, replacing its data with a new
    * version.  This is equivalent to deleting the old record and inserting a
@@ -162,9 +246,10 @@ class Page {
   void updateRecord(const RecordId& record_id, const std::string& record_data);
 
   /**
-   * Deletes the record with the given ID.  Page is compacted upon delete to
-   * ensure that data of all records is contiguous.  Slot array is compacted if
-   * the slot deleted is at the end of the slot array.
+   * Deletes the record with the given ID.  The record data is not moved; the
+   * space it leaves behind is reclaimed by compaction once an insert needs
+   * it.  Slot array is compacted if the slot deleted is at the end of the slot
+   * array.
    *
    * @param record_id   ID of the record to delete.
    */
@@ -179,12 +264,21 @@ class Page {
   bool hasSpaceForRecord(const std::string& record_data) const;
 
   /**
-   * Returns this page's free space in bytes.
+   * Returns this page's free space in bytes, including space left by deleted
+   * records that has not been compacted yet.
    *
    * @return  Free space in bytes.
    */
   std::uint16_t getFreeSpace() const { return header_.free_space_upper_bound -
-                                              header_.free_space_lower_bound; }
+                                              header_.free_space_lower_bound +
+                                              header_.dead_space; }
+
+  /**
+   * Moves the data of all records together at the end of the page, so that
+   * the space left by deleted records becomes contiguous free space again.
+   * Record IDs are not affected.
+   */
+  void compact();
 
   /**
    * Returns this page's number in its file.
@@ -200,6 +294,13 @@ class Page {
    */
   PageId next_page_number() const { return header_.next_page_number; }
 
+  /**
+   * Returns the number of the previous used page before this page in its file.
+   *
+   * @return  Page number of previous used page in file.
+   */
+  PageId prev_page_number() const { return header_.prev_page_number; }
+
   /**
    * Returns an iterator at the first record in the page.
    *
@@ -240,10 +341,19 @@ class Page {
   }
 
   /**
-   * Deletes the record with the given ID.  Page is compacted upon delete to
-   * ensure that data of all records is contiguous.  Slot array is compacted if
-   * the slot deleted is at the end of the slot array and
-   * <allow_slot_compaction> is set.
+   * Sets the number of the previous used page before this page in its file.
+   *
+   * @param prev_page_number  Page number of previous used page in file.
+   */
+  void set_prev_page_number(const PageId new_prev_page_number) {
+    header_.prev_page_number = new_prev_page_number;
+  }
+
+  /**
+   * Deletes the record with the given ID.  Record data is left in place
+   * unless it borders the free space.  Slot array is compacted if the slot
+   * deleted is at the end of the slot array and <allow_slot_compaction> is
+   * set.
    *
    * @param record_id             ID of the record to delete.
    * @param allow_slot_compaction If true, the slot array will be compacted if
@@ -273,10 +383,61 @@ class Page {
   const PageSlot& getSlot(const SlotId slot_number) const;
 
   /**
-   * Returns the slot number of an available slot.  If no slots are available
-   * to be reused, allocates a new slot.  Updates available slot count in the
-   * header metadata, but does not mark returned slot as used.  If a new slot is
-   * allocated, updates the free space lower bound.
+   * Returns true if the given slot holds a record.
+   *
+   * @param slot_number   Number of slot, between 1 and MAX_PAGE_SLOTS.
+   * @return  Whether the slot is in use.
+   */
+  bool isSlotUsed(const SlotId slot_number) const {
+    return (header_.used_slots[(slot_number - 1) / 64] >>
+            ((slot_number - 1) % 64)) & 1;
+  }
+
+  /**
+   * Marks the given slot as in use or not in the used-slot bitmap.
+   *
+   * @param slot_number   Number of slot, between 1 and MAX_PAGE_SLOTS.
+   * @param used          Whether the slot holds a record.
+   */
+  void setSlotUsed(const SlotId slot_number, const bool used) {
+    const std::uint64_t bit = std::uint64_t(1) << ((slot_number - 1) % 64);
+    if (used) {
+      header_.used_slots[(slot_number - 1) / 64] |= bit;
+    } else {
+      header_.used_slots[(slot_number - 1) / 64] &= ~bit;
+    }
+  }
+
+  /**
+   * Returns the first slot in use after the given slot, found a word of the
+   * used-slot bitmap at a time.
+   *
+   * @param start   Slot to start search at, or INVALID_SLOT for the first one.
+   * @return  Next used slot after given slot or INVALID_SLOT.
+   */
+  SlotId nextUsedSlot(const SlotId start) const;
+
+  /**
+   * Returns the last slot in use, or INVALID_SLOT if the page holds no record.
+   *
+   * @return  Last used slot.
+   */
+  SlotId lastUsedSlot() const;
+
+  /**
+   * Removes the given slot, which is not in use, from the free slot list.
+   * Constant time for the head of the list, which is where slots are reused
+   * from.
+   *
+   * @param slot_number   Number of slot.
+   */
+  void unlinkFreeSlot(const SlotId slot_number);
+
+  /**
+   * Returns the slot number of an available slot: the head of the free slot
+   * list, or a new slot if the list is empty.  Updates available slot count in
+   * the header metadata, but does not mark returned slot as used.  If a new
+   * slot is allocated, updates the free space lower bound.
    *
    * Callers are responsible for making sure there is enough space to allocate a
    * new slot before calling this method.
@@ -288,6 +449,15 @@ class Page {
    */
   SlotId getAvailableSlot();
 
+  /**
+   * Compacts the page if fewer than the given number of bytes of free space
+   * are contiguous.  Callers are responsible for making sure the page has
+   * that much free space in total.
+   *
+   * @param bytes   Contiguous free space needed.
+   */
+  void reserveContiguousSpace(const std::size_t bytes);
+
   /**
    * Inserts record data into the given slot.  The slot should not be currently
    * in use.  <slot_number> must be less than <header_.num_slots>.
@@ -343,5 +513,9 @@ static_assert(Page::SIZE > sizeof(PageHeader),
               "Page size must be large enough to hold header and data.");
 static_assert(Page::DATA_SIZE > 0,
               "Page must have some space to hold data.");
+static_assert(Page::DATA_SIZE / sizeof(PageSlot) <= MAX_PAGE_SLOTS,
+              "Used-slot bitmap must cover every slot a page can hold.");
+static_assert(sizeof(Page) == Page::SIZE,
+              "Page header and data must be contiguous to be read and written in one piece.");
 
 }
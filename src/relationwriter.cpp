@@ -0,0 +1,99 @@
+/**
+ * @author See Contributors.txt for code contributors and overview of BadgerDB.
+ *
+ * @section LICENSE
+ * Copyright (c) 2012 Database Group, Computer Sciences Department, University of Wisconsin-Madison.
+ */
+
+#include <algorithm>
+#include "relationwriter.h"
+#include "exceptions/insufficient_space_exception.h"
+
+namespace badgerdb {
+
+RelationWriter::RelationWriter(PageFile *file, const std::uint32_t extentPages)
+{
+	this->file = file;
+	this->extentPages = std::max<std::uint32_t>(extentPages, 1);
+	extent.reset(new Page[this->extentPages]);
+	numPages = 0;
+}
+
+RelationWriter::~RelationWriter()
+{
+	// pages not flushed are dropped, as when an append failed
+}
+
+void RelationWriter::append(const char *record, const std::size_t length)
+{
+	append(record, length, 1);
+}
+
+void RelationWriter::append(const char *records, const std::size_t recordLength, std::size_t count)
+{
+	while (count > 0)
+	{
+		const std::size_t appended = currentPage().appendRecords(records, recordLength, count);
+		if (appended == 0)
+		{
+			nextPage(recordLength);
+			continue;
+		}
+		records += appended * recordLength;
+		count -= appended;
+	}
+}
+
+void RelationWriter::append(const RecordView *records, std::size_t count)
+{
+	while (count > 0)
+	{
+		const std::size_t appended = currentPage().appendRecords(records, count);
+		if (appended == 0)
+		{
+			nextPage(records->length);
+			continue;
+		}
+		records += appended;
+		count -= appended;
+	}
+}
+
+void RelationWriter::flush()
+{
+	// only the page being filled can be empty, if a record did not fit on it
+	if (numPages > 0 && extent[numPages - 1].getFreeSpace() == Page::DATA_SIZE)
+	{
+		numPages--;
+	}
+	file->appendPages(extent.get(), numPages);
+	numPages = 0;
+}
+
+Page& RelationWriter::currentPage()
+{
+	if (numPages == 0)
+	{
+		extent[0] = Page();
+		numPages = 1;
+	}
+	return extent[numPages - 1];
+}
+
+void RelationWriter::nextPage(const std::size_t recordLength)
+{
+	const Page &page = extent[numPages - 1];
+	if (page.getFreeSpace() == Page::DATA_SIZE)
+	{
+		throw InsufficientSpaceException(Page::INVALID_NUMBER, recordLength, page.getFreeSpace());
+	}
+
+	if (numPages == extentPages)
+	{
+		flush();
+	}
+	extent[numPages] = Page();
+	numPages++;
+}
+
+}
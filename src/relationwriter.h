@@ -0,0 +1,126 @@
+/**
+ * @author See Contributors.txt for code contributors and overview of BadgerDB.
+ *
+ * @section LICENSE
+ * Copyright (c) 2012 Database Group, Computer Sciences Department, University of Wisconsin-Madison.
+ */
+
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include "types.h"
+#include "page.h"
+#include "file.h"
+
+namespace badgerdb {
+
+/**
+ * @brief Number of pages a RelationWriter fills before adding them to the file.
+ */
+const std::uint32_t RELATIONWRITER_EXTENT = 64;
+
+/**
+ * @brief This class is used to load records into a relation in bulk.
+ *
+ * Records are appended to new pages at the end of the relation.  The pages are
+ * filled in memory, an extent at a time, and added to the file with
+ * PageFile::appendPages(), so every page is written once with the others of its
+ * extent.  Pages at the end of a file have never been read, so they bypass the
+ * buffer pool.
+ *
+ * The records appended are only sure to be in the file once flush() has been
+ * called; a writer destroyed before drops the pages it has not written yet.
+ */
+class RelationWriter
+{
+ public:
+
+  /**
+   * Opens a writer appending to a relation.
+   *
+   * @param file        File of the relation
+   * @param extentPages Number of pages filled before they are written
+   */
+  RelationWriter(PageFile *file, const std::uint32_t extentPages = RELATIONWRITER_EXTENT);
+
+  /**
+   * Drops the pages not written by flush() yet.  Never throws, so it is safe
+   * while an exception from append() is unwinding.
+   */
+  ~RelationWriter();
+
+  /**
+   * Appends one record.
+   *
+   * @param record  Bytes of the record
+   * @param length  Length of the record in bytes
+   * @throws InsufficientSpaceException If the record does not fit in an empty page
+   */
+  void append(const char *record, const std::size_t length);
+
+  /**
+   * Appends records of the same length.
+   *
+   * @param records       Bytes of the records, one after the other
+   * @param recordLength  Length of each record in bytes
+   * @param count         Number of records
+   * @throws InsufficientSpaceException If a record does not fit in an empty page
+   */
+  void append(const char *records, const std::size_t recordLength, std::size_t count);
+
+  /**
+   * Appends records of any length, in order.
+   *
+   * @param records Records to append
+   * @param count   Number of records
+   * @throws InsufficientSpaceException If a record does not fit in an empty page
+   */
+  void append(const RecordView *records, std::size_t count);
+
+  /**
+   * Adds the pages filled so far, including the last one unless it is empty,
+   * to the file.  Later records go to a new page.
+   *
+   * @throws FileIOException If the pages cannot be written
+   */
+  void flush();
+
+ private:
+  /**
+   * Returns the page being filled, starting a new one if there is none.
+   */
+  Page& currentPage();
+
+  /**
+   * Starts a new page, writing the extent first if it is full.
+   *
+   * @param recordLength  Length of the record that did not fit, to be reported
+   *                      if the page was empty already
+   * @throws InsufficientSpaceException If the page being filled is empty
+   */
+  void nextPage(const std::size_t recordLength);
+
+  /**
+   * File of the relation.
+   */
+  PageFile *file;
+
+  /**
+   * Pages being filled.
+   */
+  std::unique_ptr<Page[]> extent;
+
+  /**
+   * Number of pages in extent.
+   */
+  std::uint32_t extentPages;
+
+  /**
+   * Number of pages of extent in use, the last of which is being filled.
+   */
+  std::uint32_t numPages;
+};
+
+}
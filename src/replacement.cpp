@@ -0,0 +1,100 @@
+/**
+ * @author See Contributors.txt for code contributors and overview of BadgerDB.
+ *
+ * @section LICENSE
+ * Copyright (c) 2012 Database Group, Computer Sciences Department, University of Wisconsin-Madison.
+ */
+
+#include "replacement.h"
+
+namespace badgerdb {
+
+//----------------------------------------
+// ClockPolicy
+//----------------------------------------
+
+ClockPolicy::ClockPolicy(const std::uint32_t frames)
+	: ReplacementPolicy(frames)
+{
+}
+
+void ClockPolicy::frameLoaded(const FrameId frameNo, const AccessHint hint)
+{
+}
+
+void ClockPolicy::frameAccessed(const FrameId frameNo, const AccessHint hint)
+{
+}
+
+bool ClockPolicy::evict(const FrameId frameNo, const bool referenced)
+{
+  // a referenced frame gets a second chance
+  return !referenced;
+}
+
+void ClockPolicy::frameEvicted(const FrameId frameNo)
+{
+}
+
+void ClockPolicy::frameCleared(const FrameId frameNo)
+{
+}
+
+//----------------------------------------
+// TwoQueuePolicy
+//----------------------------------------
+
+TwoQueuePolicy::TwoQueuePolicy(const std::uint32_t frames, const double hotShare)
+	: ReplacementPolicy(frames), hot(new std::atomic<bool>[frames]), numHot(0),
+	  maxHot((std::uint32_t)(frames * hotShare))
+{
+  for (std::uint32_t i = 0; i < frames; i++)
+    hot[i].store(false, std::memory_order_relaxed);
+}
+
+void TwoQueuePolicy::cool(const FrameId frameNo)
+{
+  if (hot[frameNo].exchange(false, std::memory_order_relaxed))
+    numHot--;
+}
+
+void TwoQueuePolicy::frameLoaded(const FrameId frameNo, const AccessHint hint)
+{
+  cool(frameNo);
+}
+
+void TwoQueuePolicy::frameAccessed(const FrameId frameNo, const AccessHint hint)
+{
+  if (hint == SEQUENTIAL_ACCESS || hot[frameNo].load(std::memory_order_relaxed))
+    return;
+
+  // second access: promote, unless the hot share of the pool is used up
+  std::uint32_t hotFrames = numHot.load(std::memory_order_relaxed);
+  while (hotFrames < maxHot)
+  {
+    if (numHot.compare_exchange_weak(hotFrames, hotFrames + 1, std::memory_order_relaxed))
+    {
+      // a concurrent access may have promoted the frame already
+      if (hot[frameNo].exchange(true, std::memory_order_relaxed))
+        numHot--;
+      return;
+    }
+  }
+}
+
+bool TwoQueuePolicy::evict(const FrameId frameNo, const bool referenced)
+{
+  return !(hot[frameNo].load(std::memory_order_relaxed) && referenced);
+}
+
+void TwoQueuePolicy::frameEvicted(const FrameId frameNo)
+{
+  cool(frameNo);
+}
+
+void TwoQueuePolicy::frameCleared(const FrameId frameNo)
+{
+  cool(frameNo);
+}
+
+}
@@ -0,0 +1,219 @@
+/**
+ * @author See Contributors.txt for code contributors and overview of BadgerDB.
+ *
+ * @section LICENSE
+ * Copyright (c) 2012 Database Group, Computer Sciences Department, University of Wisconsin-Madison.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include "types.h"
+
+namespace badgerdb {
+
+/**
+ * @brief How a page is expected to be used, passed by callers of BufMgr::readPage().
+ */
+enum AccessHint
+{
+	/**
+	 * The page may well be read again soon
+	 */
+	NORMAL_ACCESS,
+
+	/**
+	 * The page is read once as part of a scan and should not displace other pages
+	 */
+	SEQUENTIAL_ACCESS
+};
+
+/**
+* @brief Interface of the page replacement policies of the buffer manager.
+*
+* The buffer manager keeps the referenced bit of every frame: it is set when
+* the frame is pinned other than sequentially and cleared whenever the policy
+* inspects the frame.  A policy chooses the order in which frames are
+* inspected and decides which unpinned frames may be evicted.  frameLoaded()
+* and frameCleared() are called with the latch of the frame held;
+* nextCandidate(), frameAccessed() and evict() take no latch and may run
+* concurrently, even for the same frame.
+*/
+class ReplacementPolicy
+{
+ public:
+	/**
+   * Constructor of ReplacementPolicy class
+	 *
+	 * @param frames  Number of frames in the buffer pool
+	 */
+  explicit ReplacementPolicy(const std::uint32_t frames)
+		: numFrames(frames), hand(0)
+	{
+	}
+
+	/**
+   * Destructor of ReplacementPolicy class
+	 */
+  virtual ~ReplacementPolicy()
+	{
+	}
+
+	/**
+   * Get number of frames the policy was created for
+	 */
+  std::uint32_t getNumFrames() const
+	{
+		return numFrames;
+	}
+
+	/**
+	 * Returns the next frame to inspect for eviction.  May be called concurrently.
+	 * The default sweeps over all frames like the hand of a clock.
+	 *
+	 * @return  Frame number
+	 */
+  virtual FrameId nextCandidate()
+	{
+		return hand.fetch_add(1, std::memory_order_relaxed) % numFrames;
+	}
+
+	/**
+	 * Number of frames the buffer manager inspects before deciding that every
+	 * frame is pinned.
+	 */
+  virtual std::uint32_t scanLimit() const
+	{
+		return 2 * numFrames;
+	}
+
+	/**
+	 * Called when a page has been read into a frame.
+	 *
+	 * @param frameNo  Frame number
+	 * @param hint     How the page is expected to be used
+	 */
+  virtual void frameLoaded(const FrameId frameNo, const AccessHint hint) = 0;
+
+	/**
+	 * Called when a page already in a frame is pinned again.
+	 *
+	 * @param frameNo  Frame number
+	 * @param hint     How the page is expected to be used
+	 */
+  virtual void frameAccessed(const FrameId frameNo, const AccessHint hint) = 0;
+
+	/**
+	 * Decides whether an unpinned frame holding a page may be evicted.  The
+	 * buffer manager may still keep the page, for instance when another thread
+	 * holds the frame latch, so this must not change the state kept for the
+	 * frame; frameEvicted() is called once the page is actually evicted.
+	 *
+	 * @param frameNo     Frame number
+	 * @param referenced  True if the frame has been referenced since last inspected
+	 * @return            True to evict the page, false to spare it for now
+	 */
+  virtual bool evict(const FrameId frameNo, const bool referenced) = 0;
+
+	/**
+	 * Called when the page of a frame that evict() chose has been evicted.
+	 *
+	 * @param frameNo  Frame number
+	 */
+  virtual void frameEvicted(const FrameId frameNo) = 0;
+
+	/**
+	 * Called when a frame no longer holds a page for reasons other than eviction,
+	 * such as when its file is flushed or its page disposed.
+	 *
+	 * @param frameNo  Frame number
+	 */
+  virtual void frameCleared(const FrameId frameNo) = 0;
+
+ protected:
+	/**
+   * Number of frames in the buffer pool
+	 */
+  const std::uint32_t numFrames;
+
+	/**
+   * Current position of the clock hand, modulo numFrames
+	 */
+  std::atomic<FrameId> hand;
+};
+
+/**
+* @brief The clock algorithm: a frame is evicted when the hand finds it unreferenced.
+*
+* Pages read sequentially are loaded unreferenced, so a scan mostly recycles
+* its own frames.
+*/
+class ClockPolicy : public ReplacementPolicy
+{
+ public:
+	/**
+   * Constructor of ClockPolicy class
+	 *
+	 * @param frames  Number of frames in the buffer pool
+	 */
+  explicit ClockPolicy(const std::uint32_t frames);
+
+  void frameLoaded(const FrameId frameNo, const AccessHint hint) override;
+  void frameAccessed(const FrameId frameNo, const AccessHint hint) override;
+  bool evict(const FrameId frameNo, const bool referenced) override;
+  void frameEvicted(const FrameId frameNo) override;
+  void frameCleared(const FrameId frameNo) override;
+};
+
+/**
+* @brief Scan resistant clock in the manner of 2Q.
+*
+* Frames start out cold, on probation.  A cold frame is evicted whenever the
+* hand reaches it.  A page pinned again while it is cold, other than
+* sequentially, becomes hot, up to a share of the pool.  Hot frames get the
+* second chance of the clock algorithm.  Pages that are only ever scanned
+* therefore never displace pages that are used repeatedly, such as B+ tree
+* nodes.
+*/
+class TwoQueuePolicy : public ReplacementPolicy
+{
+ public:
+	/**
+   * Constructor of TwoQueuePolicy class
+	 *
+	 * @param frames    Number of frames in the buffer pool
+	 * @param hotShare  Largest share of the frames that may be hot
+	 */
+  TwoQueuePolicy(const std::uint32_t frames, const double hotShare = 0.75);
+
+  void frameLoaded(const FrameId frameNo, const AccessHint hint) override;
+  void frameAccessed(const FrameId frameNo, const AccessHint hint) override;
+  bool evict(const FrameId frameNo, const bool referenced) override;
+  void frameEvicted(const FrameId frameNo) override;
+  void frameCleared(const FrameId frameNo) override;
+
+ private:
+	/**
+   * Marks a frame cold.
+	 */
+  void cool(const FrameId frameNo);
+
+	/**
+   * True for the frames that are hot
+	 */
+  std::unique_ptr<std::atomic<bool>[]> hot;
+
+	/**
+   * Number of hot frames
+	 */
+  std::atomic<std::uint32_t> numHot;
+
+	/**
+   * Largest number of hot frames
+	 */
+  const std::uint32_t maxHot;
+};
+
+}